@@ -0,0 +1,269 @@
+#include "CImg.h"
+#include "fish.h"
+#include <random>
+#include <cmath>
+
+using namespace cimg_library;
+
+
+namespace fish{
+	// Matrices are 4 x 4, row-major, mapping homogeneous input coordinates (x, y, z, 1) to output
+	// coordinates. Pixel (x, y, z) covers [x, x + 1) x [y, y + 1) x [z, z + 1), as in rotate_coord.
+
+	void affine_identity(float affmat[16]) {
+		for (int i = 0; i < 16; i++) affmat[i] = (i % 5 == 0) ? 1 : 0;
+	}
+
+
+	void affine_compose(const float second[16], const float first[16], float affmat[16]) {
+		// Matrix applying first, then second
+		float product[16];
+		for (int r = 0; r < 4; r++) {
+			for (int c = 0; c < 4; c++) {
+				double sum = 0;
+				for (int k = 0; k < 4; k++) sum += (double) second[r * 4 + k] * first[k * 4 + c];
+				product[r * 4 + c] = sum;
+			}
+		}
+		for (int i = 0; i < 16; i++) affmat[i] = product[i];
+	}
+
+
+	void affine_translation(const float shift_x, const float shift_y, const float shift_z, float affmat[16]) {
+		affine_identity(affmat);
+		affmat[3] = shift_x;
+		affmat[7] = shift_y;
+		affmat[11] = shift_z;
+	}
+
+
+	void affine_scaling(const float scale_x, const float scale_y, const float scale_z, float affmat[16]) {
+		affine_identity(affmat);
+		affmat[0] = scale_x;
+		affmat[5] = scale_y;
+		affmat[10] = scale_z;
+	}
+
+
+	void affine_rotation(const float angle, const float centre_x, const float centre_y, float affmat[16]) {
+		// In-plane rotation about (centre_x, centre_y), matching rotate_coord
+		const double theta = -angle * M_PI / 180;
+		const float c = std::cos(theta), s = std::sin(theta);
+		affine_identity(affmat);
+		affmat[0] = c;
+		affmat[1] = -s;
+		affmat[3] = centre_x - c * centre_x + s * centre_y;
+		affmat[4] = s;
+		affmat[5] = c;
+		affmat[7] = centre_y - s * centre_x - c * centre_y;
+	}
+
+
+	bool affine_chain(const char* chain, int &width, int &height, int &depth, float affmat[16]) {
+		// Compose comma-separated steps, applied left to right, e.g. "rotate:30,translate:1.5:-2,scale:0.5".
+		// Rotations are about the centre of the current frame, and scaling resizes the frame, so width,
+		// height and depth (the input size on entry) become the output size.
+		affine_identity(affmat);
+		float out_width = width, out_height = height, out_depth = depth;
+		const char* step = chain;
+		while (step && *step) {
+			float p[12] = {0}, step_mat[16];
+			char name[16];
+			int num_chars = 0;
+			if (sscanf(step, "%15[a-z]%n", name, &num_chars) != 1) return false;
+			const char* params = step + num_chars;
+			int num_params = 0;
+			while (*params == ':' && num_params < 12) {
+				if (sscanf(params + 1, "%f%n", &p[num_params], &num_chars) != 1) return false;
+				num_params++;
+				params += 1 + num_chars;
+			}
+
+			if (!strcmp(name, "rotate") && num_params == 1) {
+				affine_rotation(p[0], out_width / 2, out_height / 2, step_mat);
+			} else if (!strcmp(name, "translate") && (num_params == 2 || num_params == 3)) {
+				affine_translation(p[0], p[1], p[2], step_mat);
+			} else if (!strcmp(name, "scale") && num_params >= 1 && num_params <= 3) {
+				const float sx = p[0], sy = num_params > 1 ? p[1] : p[0], sz = num_params > 2 ? p[2] : (depth > 1 ? sx : 1);
+				affine_scaling(sx, sy, sz, step_mat);
+				out_width *= sx;
+				out_height *= sy;
+				out_depth *= sz;
+			} else if (!strcmp(name, "matrix") && num_params == 12) {
+				affine_identity(step_mat);
+				for (int i = 0; i < 12; i++) step_mat[i] = p[i];
+			} else {
+				return false;
+			}
+			affine_compose(step_mat, affmat, affmat);
+
+			if (*params == ',') params++;
+			else if (*params) return false;
+			step = params;
+		}
+		width = std::max(1, (int) ceil(out_width - 1e-3));
+		height = std::max(1, (int) ceil(out_height - 1e-3));
+		depth = std::max(1, (int) ceil(out_depth - 1e-3));
+		return true;
+	}
+
+
+	SampleTargets::SampleTargets(const int num_samples) :
+		targets(num_samples), hits(num_samples), num_targets(0), num_samples(num_samples) {
+	}
+
+
+	void SampleTargets::clear() {
+		num_targets = 0;
+	}
+
+
+	void SampleTargets::add(const long target) {
+		int t = 0;
+		while (t < num_targets && targets[t] != target) t++;
+		if (t == num_targets) {
+			targets[num_targets] = target;
+			hits[num_targets++] = 0;
+		}
+		hits[t]++;
+	}
+
+
+	void SampleTargets::deposit(CImg<> &out, const float value, std::default_random_engine &generator) const {
+		// Photon counts are split multinomially; other values in proportion
+		if (value >= 0 && value == floor(value)) {
+			int photon_num = value, remaining = num_samples;
+			for (int t = 0; t < num_targets && photon_num > 0; t++) {
+				std::binomial_distribution<> bdist(photon_num, (double) hits[t] / remaining);
+				const int landed = bdist(generator);
+				photon_num -= landed;
+				remaining -= hits[t];
+				if (targets[t] >= 0 && landed) {
+					#pragma omp atomic
+					out[targets[t]] += landed;
+				}
+			}
+		} else {
+			for (int t = 0; t < num_targets; t++) {
+				if (targets[t] < 0) continue;
+				#pragma omp atomic
+				out[targets[t]] += value * hits[t] / num_samples;
+			}
+		}
+	}
+
+
+	CImg<> affine_coord(const CImg<> &raw, const float affmat[16], const int width, const int height, const int depth) {
+		CImg<> transformed(width, height, depth, 1, 0);
+		const unsigned int seed = fish::random_seed();
+		const bool volume = raw.depth() > 1;
+
+		#pragma omp parallel for schedule(dynamic)
+		for (int row = 0; row < raw.height() * raw.depth(); row++) {
+			const int y = row % raw.height(), z = row / raw.height();
+			std::default_random_engine generator = fish::random_generator(seed, row);
+			std::uniform_real_distribution<float> ddist(0.0, 1.0);
+			for (int x = 0; x < raw.width(); x++) {
+				int photon_num = raw(x, y, z);
+				for (int i = 0; i < photon_num; i++) {
+					const double xpos = x + ddist(generator);
+					const double ypos = y + ddist(generator);
+					const double zpos = volume ? z + ddist(generator) : z;
+					const int px = floor(affmat[0] * xpos + affmat[1] * ypos + affmat[2] * zpos + affmat[3]);
+					const int py = floor(affmat[4] * xpos + affmat[5] * ypos + affmat[6] * zpos + affmat[7]);
+					const int pz = floor(affmat[8] * xpos + affmat[9] * ypos + affmat[10] * zpos + affmat[11]);
+					if (transformed.containsXYZC(px, py, pz)) {
+						#pragma omp atomic
+						transformed(px, py, pz) += 1;
+					}
+				}
+			}
+		}
+
+		return transformed;
+	}
+
+
+	CImg<> affine_area(const CImg<> &raw, const float affmat[16], const int width, const int height, const int depth) {
+		// Each input pixel is sampled on a regular sub-grid; its photons are then split multinomially
+		// between the output pixels in proportion to how many sub-samples land in each. The grid has four
+		// samples per output pixel along each axis, so magnified pixels still spread over their whole
+		// footprint, up to 32 samples per axis in a plane and 16 in a volume.
+		CImg<> transformed(width, height, depth, 1, 0);
+		const unsigned int seed = fish::random_seed();
+		const bool volume = raw.depth() > 1;
+		int sub[3];
+		for (int c = 0; c < 3; c++) {
+			// Length of an input pixel edge along axis c once transformed
+			const double stretch = std::sqrt((double) affmat[c] * affmat[c] + (double) affmat[4 + c] * affmat[4 + c] +
+											 (double) affmat[8 + c] * affmat[8 + c]);
+			sub[c] = std::min(volume ? 16 : 32, std::max(4, (int) ceil(4 * stretch - 1e-3)));
+		}
+		if (!volume) sub[2] = 1;
+		const int num_samples = sub[0] * sub[1] * sub[2];
+
+		// Sub-sample offsets, already transformed by the linear part of the matrix
+		CImg<double> offsets(num_samples, 3);
+		for (int i = 0; i < num_samples; i++) {
+			const double dx = (i % sub[0] + 0.5) / sub[0], dy = (i / sub[0] % sub[1] + 0.5) / sub[1];
+			const double dz = volume ? (i / (sub[0] * sub[1]) + 0.5) / sub[2] : 0;
+			for (int r = 0; r < 3; r++) {
+				offsets(i, r) = affmat[r * 4] * dx + affmat[r * 4 + 1] * dy + affmat[r * 4 + 2] * dz;
+			}
+		}
+
+		#pragma omp parallel for schedule(dynamic)
+		for (int row = 0; row < raw.height() * raw.depth(); row++) {
+			const int y = row % raw.height(), z = row / raw.height();
+			std::default_random_engine generator = fish::random_generator(seed, row);
+			SampleTargets targets(num_samples);
+			for (int x = 0; x < raw.width(); x++) {
+				const float v = raw(x, y, z);
+				if (v == 0) continue;
+				const double base_x = affmat[0] * x + affmat[1] * y + affmat[2] * z + affmat[3];
+				const double base_y = affmat[4] * x + affmat[5] * y + affmat[6] * z + affmat[7];
+				const double base_z = affmat[8] * x + affmat[9] * y + affmat[10] * z + affmat[11];
+
+				targets.clear();
+				for (int i = 0; i < num_samples; i++) {
+					const int px = floor(base_x + offsets(i, 0));
+					const int py = floor(base_y + offsets(i, 1));
+					const int pz = floor(base_z + offsets(i, 2));
+					targets.add(transformed.containsXYZC(px, py, pz) ? (long) transformed.offset(px, py, pz) : -1);
+				}
+				targets.deposit(transformed, v, generator);
+			}
+		}
+
+		return transformed;
+	}
+
+
+	CImg<> affine(const CImg<> &raw, const float affmat[16], const int width, const int height, const int depth, const char* method) {
+		CImg<> transformed;
+
+		int start_time = cimg::time();
+		printf("\nApplying affine transform using ");
+		if (!strcmp(method, "coord")) {
+			printf("coord draw method...");
+			fflush(stdout);
+			transformed = affine_coord(raw, affmat, width, height, depth);
+		} else if (!strcmp(method, "area")) {
+			printf("area-weighted method...");
+			fflush(stdout);
+			transformed = affine_area(raw, affmat, width, height, depth);
+		} else {
+			printf("%s method not implemented.\n", method);
+			exit(1);
+		}
+		int affine_time = cimg::time() - start_time;
+		printf(" (completed in %d ms)\n", affine_time);
+
+		return transformed;
+	}
+
+
+	CImg<> affine(const CImg<> &raw, const float affmat[16], const char* method) {
+		return affine(raw, affmat, raw.width(), raw.height(), raw.depth(), method);
+	}
+}
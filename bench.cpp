@@ -0,0 +1,138 @@
+#include "harness.h"
+#include <omp.h>
+#include <chrono>
+
+// Times every kernel on synthetic photon images across sizes, densities and thread counts, and writes the
+// results as JSON, e.g. to compare versions: fish_bench -sizes 256,1024 -densities 1,20 -o bench.json
+
+std::vector<double> parse_values(const char* list) {
+	std::vector<double> values;
+	for (const char* p = list; p; p = strchr(p, ',') ? strchr(p, ',') + 1 : 0) values.push_back(atof(p));
+	return values;
+}
+
+
+CImg<> synthetic_image(const int size, const double density, const unsigned int seed) {
+	// Poisson counts around a smooth pattern, with the given mean photons per pixel
+	CImg<> img(size, size, 1, 1);
+	#pragma omp parallel for
+	for (int y = 0; y < size; y++) {
+		std::default_random_engine generator = fish::random_generator(seed, y);
+		for (int x = 0; x < size; x++) {
+			const double pattern = 1 + 0.5 * sin(x * 0.05) * cos(y * 0.07);
+			std::poisson_distribution<> pdist(density * pattern);
+			img(x, y) = pdist(generator);
+		}
+	}
+	return img;
+}
+
+
+std::vector<Kernel> kernels(const char* file_tmp) {
+	// The photon kernels fish_test checks, followed by those it does not
+	std::vector<Kernel> list = photon_kernels();
+	list.push_back(Kernel{"rebin_up_nn", [](const CImg<> &img) { return fish::rebin(img, 2, "up_nn"); }});
+	list.push_back(Kernel{"rebin_up_fourier", [](const CImg<> &img) { return fish::rebin(img, 2, "up_fourier"); }});
+	list.push_back(Kernel{"rebin_up_fourier_poisson", [](const CImg<> &img) { return fish::rebin(img, 2, "up_fourier_poisson"); }});
+	list.push_back(Kernel{"rebin_up_thin_fourier", [](const CImg<> &img) { return fish::rebin(img, 2, "up_thin_fourier"); }});
+	list.push_back(Kernel{"rebin_up_thin_fourier_poisson", [](const CImg<> &img) { return fish::rebin(img, 2, "up_thin_fourier_poisson"); }});
+	const float peak = 1;
+	const CImg<> psf = CImg<>(9, 9, 1, 1, 0).draw_gaussian(4.0f, 4.0f, 1.5f, &peak);
+	list.push_back(Kernel{"rebin_rl", [psf](const CImg<> &img) { return fish::rebin_rl(img, 2, psf, 10); }});
+	for (const char* method : {"coord", "nn"}) {
+		list.push_back(Kernel{method == std::string("coord") ? "rotate3d_coord" : "rotate3d_nn", [method](const CImg<> &img) {
+			const float axis[3] = {0, 0, 1}, centre[3] = {img.width() / 2.0f, img.height() / 2.0f, 0.5f};
+			return fish::rotate3d(img, 30, axis, centre, method);
+		}});
+	}
+	list.push_back(Kernel{"scale", [](const CImg<> &img) { return fish::scale(img, 1.0, 1.5); }});
+	list.push_back(Kernel{"error", [](const CImg<> &img) {
+		const CImg<> shifted = img.get_shift(1, 0, 0, 0, 2);
+		return CImg<>(1, 1, 1, 1, (float) fish::error_value(shifted, img, "rmse"));
+	}});
+	const std::string tmp = file_tmp;
+	list.push_back(Kernel{"save", [tmp](const CImg<> &img) {
+		CImg<> out(img);
+		fish::save_tiff(out, tmp.c_str(), 0, 0);
+		return out;
+	}});
+	list.push_back(Kernel{"load", [tmp](const CImg<> &) {
+		return fish::load_tiff(tmp.c_str());
+	}});
+	return list;
+}
+
+
+double time_kernel(const Kernel &kernel, const CImg<> &img, const int repeats) {
+	// Best of several runs, in seconds
+	const int saved = mute_stdout();
+	double best = 0;
+	for (int r = 0; r < repeats; r++) {
+		const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		const CImg<> out = kernel.run(img);
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (!r || seconds < best) best = seconds;
+	}
+	fish::restore_stdout(saved);
+	return best;
+}
+
+
+int main(int argc, char* argv[]) {
+	cimg_help("\nBenchmark fish kernels on synthetic photon images, writing the results as JSON");
+
+	const char * sizes_str = cimg_option("-sizes", "256,1024", "image sizes (square), separated by commas");
+	const char * densities_str = cimg_option("-densities", "1,20", "mean photons per pixel, separated by commas");
+	const char * threads_str = cimg_option("-threads", (char*) 0, "thread counts, separated by commas; speedups are relative to the first (default 1 and all)");
+	const char * only = cimg_option("-k", (char*) 0, "only kernels whose names contain this");
+	const int repeats = cimg_option("-r", 3, "runs per measurement (the best is kept)");
+	const char * file_tmp = cimg_option("-tmp", "/tmp/fish_bench.tif", "scratch file for load and save");
+	const char * file_out = cimg_option("-o", (char*) 0, "output JSON file (default stdout)\n");
+	if (cimg_option("-h", false, 0)) {return 0;}
+
+	const std::vector<double> sizes = parse_values(sizes_str), densities = parse_values(densities_str);
+	const int max_threads = omp_get_max_threads();
+	std::vector<double> threads = threads_str ? parse_values(threads_str) : std::vector<double>(1, 1);
+	if (!threads_str && max_threads > 1) threads.push_back(max_threads);
+	const std::vector<Kernel> list = kernels(file_tmp);
+
+	std::FILE *out = file_out ? std::fopen(file_out, "w") : stdout;
+	if (!out) {
+		printf("\nCould not open %s for writing.\n", file_out);
+		return 1;
+	}
+	std::fprintf(out, "{\n  \"max_threads\": %d,\n  \"repeats\": %d,\n  \"results\": [", max_threads, repeats);
+	bool first = true;
+	for (size_t s = 0; s < sizes.size(); s++) {
+		for (size_t d = 0; d < densities.size(); d++) {
+			CImg<> img = synthetic_image(sizes[s], densities[d], 1);
+			const double pixels = img.size(), photons = img.sum();
+			const int saved = mute_stdout();
+			fish::save_tiff(img, file_tmp, 0, 0);
+			fish::restore_stdout(saved);
+			for (size_t k = 0; k < list.size(); k++) {
+				if (only && !strstr(list[k].name, only)) continue;
+				std::fprintf(out, "%s\n    {\"kernel\": \"%s\", \"width\": %d, \"height\": %d, \"density\": %g, \"photons\": %.0f, \"runs\": [",
+							 first ? "" : ",", list[k].name, img.width(), img.height(), densities[d], photons);
+				first = false;
+				double serial = 0;
+				for (size_t t = 0; t < threads.size(); t++) {
+					omp_set_num_threads(threads[t]);
+					fish::set_random_seed(1);
+					const double seconds = time_kernel(list[k], img, repeats);
+					if (!t) serial = seconds;
+					std::fprintf(out, "%s\n      {\"threads\": %d, \"seconds\": %.6g, \"pixels_per_s\": %.6g, \"photons_per_s\": %.6g, \"speedup\": %.3g}",
+								 t ? "," : "", (int) threads[t], seconds, pixels / seconds, photons / seconds, serial / seconds);
+				}
+				std::fprintf(out, "\n    ]}");
+				std::fflush(out);
+			}
+			omp_set_num_threads(max_threads);
+		}
+	}
+	std::fprintf(out, "\n  ]\n}\n");
+	if (file_out) std::fclose(out);
+	std::remove(file_tmp);
+
+	return 0;
+}
@@ -0,0 +1,100 @@
+#include "CImg.h"
+#include "fish.h"
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+using namespace cimg_library;
+
+
+namespace fish{
+	static CImg<> bootstrap_terms(const CImg<> &est, const CImg<> &truth, const char* method) {
+		// Per-pixel terms whose mean gives the metric, or its mean squared error
+		if (!strcmp(method, "mse") || !strcmp(method, "rmse") || !strcmp(method, "psnr")) {
+			check_same_size(est, truth);
+			CImg<> terms(truth.width(), truth.height(), truth.depth(), 1);
+			const long size = truth.size();
+			#pragma omp parallel for simd
+			for (long i = 0; i < size; i++) {
+				const float d = est[i] - truth[i];
+				terms[i] = d * d;
+			}
+			return terms;
+		}
+		if (!strcmp(method, "deviance")) return deviance_map(est, truth);
+		if (!strcmp(method, "loglik")) return log_likelihood_map(est, truth);
+		if (!strcmp(method, "ssim")) return ssim_map(est, truth);
+		printf("\n%s method cannot be bootstrapped over pixels.\n", method);
+		exit(1);
+	}
+
+
+	std::vector<double> error_bootstrap(const CImg<> &est, const CImg<> &truth, const char* method, const int num_replicates,
+										const int block) {
+		// Moving pixels one at a time would ignore the correlation between neighbours and give intervals
+		// that are too narrow, so each replicate instead draws as many block x block tiles of each slice as
+		// there are, with replacement, from its own stream. Tiles at the edges are smaller, so the metric
+		// is the sum over the drawn tiles divided by their pixel count.
+		const CImg<> terms = bootstrap_terms(est, truth, method);
+		const int tiles_x = (terms.width() + block - 1) / block, tiles_y = (terms.height() + block - 1) / block;
+		const long num_tiles = (long) tiles_x * tiles_y * terms.depth();
+		std::vector<double> tile_sums(num_tiles, 0);
+		std::vector<long> tile_sizes(num_tiles, 0);
+		#pragma omp parallel for
+		for (long tile = 0; tile < num_tiles; tile++) {
+			const int x0 = (tile % tiles_x) * block, y0 = (tile / tiles_x % tiles_y) * block, z = tile / tiles_x / tiles_y;
+			const int x1 = std::min(x0 + block, terms.width()), y1 = std::min(y0 + block, terms.height());
+			double sum = 0;
+			for (int y = y0; y < y1; y++) {
+				for (int x = x0; x < x1; x++) sum += terms(x, y, z);
+			}
+			tile_sums[tile] = sum;
+			tile_sizes[tile] = (long) (x1 - x0) * (y1 - y0);
+		}
+
+		const unsigned int seed = fish::random_seed();
+		const double full = error_value(est, truth, method), full_mean = terms.mean();
+		std::vector<double> values(num_replicates);
+
+		#pragma omp parallel for schedule(dynamic)
+		for (int b = 0; b < num_replicates; b++) {
+			std::default_random_engine generator = fish::random_generator(seed, b);
+			std::uniform_int_distribution<long> idist(0, num_tiles - 1);
+			double sum = 0;
+			long size = 0;
+			for (long i = 0; i < num_tiles; i++) {
+				const long tile = idist(generator);
+				sum += tile_sums[tile];
+				size += tile_sizes[tile];
+			}
+			const double mean = sum / size;
+			if (!strcmp(method, "rmse")) values[b] = sqrt(mean);
+			else if (!strcmp(method, "psnr")) values[b] = mean > 0 ? full + 10 * std::log10(full_mean / mean) : INFINITY;
+			else values[b] = mean;
+		}
+		return values;
+	}
+
+
+	void bootstrap_interval(std::vector<double> values, const double level, double &lower, double &upper) {
+		// Percentile interval, interpolating between order statistics
+		std::sort(values.begin(), values.end());
+		const double alpha = (1 - level) / 2;
+		for (int side = 0; side < 2; side++) {
+			const double pos = (side ? 1 - alpha : alpha) * (values.size() - 1);
+			const size_t below = floor(pos), above = std::min(below + 1, values.size() - 1);
+			const double v = values[below] + (pos - below) * (values[above] - values[below]);
+			if (side) upper = v;
+			else lower = v;
+		}
+	}
+
+
+	void bootstrap_report(const char* method, const std::vector<double> &values) {
+		double mean = 0, lower = 0, upper = 0;
+		for (size_t b = 0; b < values.size(); b++) mean += values[b];
+		mean /= values.size();
+		bootstrap_interval(values, 0.95, lower, upper);
+		printf("Calculated %s: %f, 95%% interval [%f, %f] over %d replicates\n", method, mean, lower, upper, (int) values.size());
+	}
+}
@@ -1,6 +1,8 @@
 #include "CImg.h"
+#include "fish.h"
 #include <random>
 #include <cmath>
+#include <vector>
 
 using namespace cimg_library;
 
@@ -8,7 +10,7 @@ using namespace cimg_library;
 namespace fish{
 	CImg<> dim_binom(const CImg<> &raw, const float scale) {
 		CImg<> dimmed(raw.width(), raw.height(), 1, 1, 0);
-		std::default_random_engine generator;
+		std::default_random_engine generator = fish::random_generator(fish::random_seed(), 0);
 
 		if (scale > 1.0) {
 			printf("\nScale > 1.0 not supported. Please use intensify instead.\n");
@@ -37,4 +39,39 @@ namespace fish{
 
 		return dimmed;
 	}
+
+
+	CImgList<> dim_series(const CImg<> &raw, const std::vector<float> &levels) {
+		// Dim to every level in one pass. Each level is thinned from the previous (brighter) one with the
+		// conditional probability levels[k] / levels[k - 1], so the series is nested: every photon kept
+		// at one level is also present at all brighter levels.
+		for (size_t k = 0; k < levels.size(); k++) {
+			if (levels[k] > 1.0 || levels[k] < 0 || (k > 0 && levels[k] > levels[k - 1])) {
+				printf("\nLevels must be in [0, 1] and non-increasing.\n");
+				exit(1);
+			}
+		}
+		CImgList<> dimmed(levels.size(), raw.width(), raw.height(), raw.depth(), 1, 0);
+		const unsigned int seed = fish::random_seed();
+
+		#pragma omp parallel for
+		for (int row = 0; row < raw.height() * raw.depth(); row++) {
+			const int y = row % raw.height(), z = row / raw.height();
+			std::default_random_engine generator = fish::random_generator(seed, row);
+			for (int x = 0; x < raw.width(); x++) {
+				int photon_num = raw(x, y, z);
+				float previous_level = 1.0;
+				for (size_t k = 0; k < levels.size(); k++) {
+					if (levels[k] < previous_level && photon_num > 0) {
+						std::binomial_distribution<> ddist(photon_num, levels[k] / previous_level);
+						photon_num = ddist(generator);
+					}
+					previous_level = levels[k];
+					dimmed[k](x, y, z) = photon_num;
+				}
+			}
+		}
+
+		return dimmed;
+	}
 }
@@ -1,46 +1,200 @@
 #include "CImg.h"
+#include "fish.h"
+#include <omp.h>
+#include <string>
+#include <vector>
 
 using namespace cimg_library;
 
 
 namespace fish{
-	double error_mse(const CImg<> &est, const CImg<> truth, const char* method) {
-		double error_val = 0.0;
-		cimg_forXY(est, x, y) {
-			error_val += pow(abs(est(x, y) - truth(x, y)), 2);
-		}
-		return error_val / (truth.width() * truth.height());
+	double error_mse(const CImg<> &est, const CImg<> &truth) {
+		// Over every plane of a stack
+		check_same_size(est, truth);
+		const float *const e = est.data(), *const t = truth.data();
+		const double sum = block_sum(truth.size(), [=](const long i) {
+			const double d = (double) e[i] - t[i];
+			return d * d;
+		});
+		return sum / truth.size();
 	}
 
-	double error_rmse(const CImg<> &est, const CImg<> truth, const char* method) {
-		double error_val = 0.0;
-		cimg_forXY(est, x, y) {
-			error_val += pow(abs(est(x, y) - truth(x, y)), 2);
-		}
-		return sqrt(error_val / (truth.width() * truth.height()));
+	double error_rmse(const CImg<> &est, const CImg<> &truth) {
+		return sqrt(error_mse(est, truth));
+	}
+
+
+	const char* error_description(const char* method) {
+		// Name of a metric for reports, or 0 if there is no such metric
+		if (!strcmp(method, "rmse")) return "root mean squared error";
+		if (!strcmp(method, "mse")) return "mean squared error";
+		if (!strcmp(method, "psnr")) return "peak signal-to-noise ratio";
+		if (!strcmp(method, "deviance")) return "Poisson deviance";
+		if (!strcmp(method, "loglik")) return "Poisson log-likelihood";
+		if (!strcmp(method, "ssim")) return "structural similarity";
+		if (!strcmp(method, "ms_ssim")) return "multi-scale structural similarity";
+		return 0;
+	}
+
+
+	double error_value(const CImg<> &est, const CImg<> &truth, const char* method) {
+		// The metric alone, without reporting, e.g. for use inside parallel loops
+		if (!strcmp(method, "rmse")) return error_rmse(est, truth);
+		if (!strcmp(method, "mse")) return error_mse(est, truth);
+		if (!strcmp(method, "psnr")) return error_psnr(est, truth);
+		if (!strcmp(method, "deviance")) return error_deviance(est, truth);
+		if (!strcmp(method, "loglik")) return error_log_likelihood(est, truth);
+		if (!strcmp(method, "ssim")) return error_ssim(est, truth);
+		if (!strcmp(method, "ms_ssim")) return error_ms_ssim(est, truth);
+		printf("\n%s method not implemented.\n", method);
+		exit(1);
 	}
 
 
-	double error(const CImg<> &est, const CImg<> truth, const char* method) {
+	double error(const CImg<> &est, const CImg<> &truth, const char* method) {
 		double error_val = 0.0;
 
 		int start_time = cimg::time();
 		printf("\nCalculating error using ");
-		if (!strcmp(method, "rmse")) {
-			printf("root mean squared error method...");
-			error_val = error_rmse(est, truth, method);
-		} else if (!strcmp(method, "mse")) {
-			printf("mean squared error method...");
-			error_val = error_mse(est, truth, method);
-		} else if (!strcmp(method, "psnr")) {
-			printf("no");
-		} else {
+		const char* description = error_description(method);
+		if (!description) {
 			printf("%s method not implemented.\n", method);
 			exit(1);
 		}
+		printf("%s method...", description);
+		fflush(stdout);
+		error_val = error_value(est, truth, method);
 		int error_time = cimg::time() - start_time;
 		printf(" (completed in %d ms)\n", error_time);
 
 		return error_val;
 	}
+
+
+	void error_frames(const char* file_est, const char* file_truth, const std::vector<std::string> &methods, const char* file_out) {
+		// Metrics for each frame of a pair of stacks, streamed in batches of at least 64 frames, as reopening a
+		// file for each few frames walks its directory chain from the start every time. Rows go to file_out as
+		// CSV, or JSON if it ends in .json, or to stdout as CSV without one.
+		for (size_t m = 0; m < methods.size(); m++) {
+			if (!error_description(methods[m].c_str())) {
+				printf("\n%s method not implemented.\n", methods[m].c_str());
+				exit(1);
+			}
+		}
+		const int num_frames = fish::tiff_num_frames(file_est);
+		if (fish::tiff_num_frames(file_truth) != num_frames) {
+			printf("\n%s and %s have different numbers of frames.\n", file_est, file_truth);
+			exit(1);
+		}
+		std::FILE* out = file_out ? std::fopen(file_out, "w") : stdout;
+		if (!out) {
+			printf("\nCould not open %s for writing.\n", file_out);
+			exit(1);
+		}
+		const char* extension = file_out ? strrchr(file_out, '.') : 0;
+		const bool json = extension && !strcmp(extension, ".json");
+		if (json) {
+			std::fprintf(out, "{\"frames\": [");
+		} else {
+			std::fprintf(out, "frame");
+			for (size_t m = 0; m < methods.size(); m++) std::fprintf(out, ",%s", methods[m].c_str());
+			std::fprintf(out, "\n");
+		}
+
+		int start_time = cimg::time();
+		const int batch = std::max(64, omp_get_max_threads());
+		std::vector<double> values(batch * methods.size()), totals(methods.size(), 0.0);
+		for (int first = 0; first < num_frames; first += batch) {
+			const int last = std::min(first + batch, num_frames) - 1;
+			const CImg<> est = fish::load_tiff(file_est, first, last), truth = fish::load_tiff(file_truth, first, last);
+
+			#pragma omp parallel for schedule(dynamic)
+			for (int task = 0; task < (last - first + 1) * (int) methods.size(); task++) {
+				const int frame = task / methods.size();
+				values[task] = error_value(est.get_shared_slice(frame), truth.get_shared_slice(frame), methods[task % methods.size()].c_str());
+			}
+
+			for (int frame = first; frame <= last; frame++) {
+				std::fprintf(out, json ? "%s\n  {\"frame\": %d" : "%s%d", json && frame ? "," : "", frame);
+				for (size_t m = 0; m < methods.size(); m++) {
+					const double v = values[(frame - first) * methods.size() + m];
+					totals[m] += v;
+					if (json) std::fprintf(out, ", \"%s\": %.9g", methods[m].c_str(), v);
+					else std::fprintf(out, ",%.9g", v);
+				}
+				std::fprintf(out, json ? "}" : "\n");
+			}
+		}
+		if (json) std::fprintf(out, "\n]}\n");
+		if (file_out) std::fclose(out);
+		int error_time = cimg::time() - start_time;
+
+		// Without file_out the summary goes to stderr, so stdout holds only the table
+		std::FILE* log = file_out ? stdout : stderr;
+		std::fprintf(log, "\nCompared %d frames in %d ms\n", num_frames, error_time);
+		for (size_t m = 0; m < methods.size(); m++) {
+			std::fprintf(log, "Mean %s: %f\n", methods[m].c_str(), num_frames ? totals[m] / num_frames : 0.0);
+		}
+	}
+
+
+	MetricAccumulator::MetricAccumulator(const std::vector<std::string> &methods) :
+		methods(methods), sums(methods.size(), 0.0), num_pixels(0), num_planes(0), truth_min(0), truth_max(0) {
+		for (size_t m = 0; m < methods.size(); m++) {
+			if (!error_description(methods[m].c_str())) {
+				printf("\n%s method not implemented.\n", methods[m].c_str());
+				exit(1);
+			}
+		}
+	}
+
+
+	void MetricAccumulator::add(const CImg<> &est, const CImg<> &truth) {
+		// Pixel metrics keep running sums; SSIM and MS-SSIM are taken plane by plane, each with the range of its
+		// own truth plane, so the result does not depend on how the stack is divided between calls
+		check_same_size(est, truth);
+		const long size = truth.size();
+		if (!num_pixels) truth_min = truth_max = truth[0];
+		truth_min = std::min(truth_min, truth.min());
+		truth_max = std::max(truth_max, truth.max());
+		for (size_t m = 0; m < methods.size(); m++) {
+			const std::string &method = methods[m];
+			if (method == "mse" || method == "rmse" || method == "psnr") {
+				sums[m] += error_mse(est, truth) * size;
+			} else if (method == "deviance") {
+				sums[m] += error_deviance(est, truth) * size;
+			} else if (method == "loglik") {
+				sums[m] += error_log_likelihood(est, truth) * size;
+			} else if (method == "ssim") {
+				for (int z = 0; z < truth.depth(); z++) {
+					sums[m] += error_ssim(est.get_shared_slice(z), truth.get_shared_slice(z)) * ((long) truth.width() * truth.height());
+				}
+			} else {
+				for (int z = 0; z < truth.depth(); z++) {
+					sums[m] += error_ms_ssim(est.get_shared_slice(z), truth.get_shared_slice(z));
+				}
+			}
+		}
+		num_pixels += size;
+		num_planes += truth.depth();
+	}
+
+
+	double MetricAccumulator::value(const int m) const {
+		const std::string &method = methods[m];
+		if (method == "rmse") return sqrt(sums[m] / num_pixels);
+		if (method == "psnr") {
+			const double range = truth_max - std::min(0.0f, truth_min);
+			return 10 * std::log10((range > 0 ? range * range : 1) / (sums[m] / num_pixels));
+		}
+		if (method == "ms_ssim") return sums[m] / num_planes;
+		return sums[m] / num_pixels;
+	}
+
+
+	void MetricAccumulator::report() const {
+		for (size_t m = 0; m < methods.size(); m++) {
+			printf("Calculated %s: %f\n", methods[m].c_str(), value(m));
+		}
+	}
 }
@@ -1,20 +1,110 @@
 #include "CImg.h"
+#include "fish.h"
 
 using namespace cimg_library;
 
 
 namespace fish{
-	CImg<> error_map_diff(const CImg<> &est, const CImg<> truth, const char* method) {
-		CImg<> errors(truth.width(), truth.height(), 1, 1, 0);
-		
-		cimg_forXY(errors, x, y) {
-			errors(x, y) = est(x, y) - truth(x, y);
+	CImg<> error_map_diff(const CImg<> &est, const CImg<> &truth, const char* method) {
+		check_same_size(est, truth);
+		CImg<> errors(truth.width(), truth.height(), truth.depth(), 1);
+		const float *const e = est.data(), *const t = truth.data();
+		float *const d = errors.data();
+		const long size = truth.size();
+
+		#pragma omp parallel for simd
+		for (long i = 0; i < size; i++) {
+			d[i] = e[i] - t[i];
 		}
 		return errors;
 	}
 
 
-	CImg<> error_map(const CImg<> &est, const CImg<> truth, const char* method) {
+	CImgList<double> error_sums(const CImg<> &est, const CImg<> &truth) {
+		// Summed-area tables, per plane, of the difference, its square and the truth. Entry (x, y) holds the
+		// sum over [0, x) x [0, y), so tables are one larger than the image in x and y.
+		check_same_size(est, truth);
+		const int width = truth.width(), height = truth.height(), depth = truth.depth();
+		CImgList<double> sums(3, width + 1, height + 1, depth, 1, 0);
+
+		#pragma omp parallel for
+		for (int row = 0; row < height * depth; row++) {
+			const int y = row % height, z = row / height;
+			double sum_d = 0, sum_d2 = 0, sum_t = 0;
+			for (int x = 0; x < width; x++) {
+				const double d = (double) est(x, y, z) - truth(x, y, z);
+				sum_d += d;
+				sum_d2 += d * d;
+				sum_t += truth(x, y, z);
+				sums[0](x + 1, y + 1, z) = sum_d;
+				sums[1](x + 1, y + 1, z) = sum_d2;
+				sums[2](x + 1, y + 1, z) = sum_t;
+			}
+		}
+
+		// Down the columns a row at a time, in blocks of columns
+		const int block = 256, num_blocks = (width + block) / block;
+		#pragma omp parallel for collapse(2)
+		for (int z = 0; z < depth; z++) {
+			for (int b = 0; b < num_blocks; b++) {
+				const int x0 = b * block, x1 = std::min(x0 + block, width + 1);
+				for (int l = 0; l < 3; l++) {
+					for (int y = 1; y <= height; y++) {
+						double *const out = sums[l].data(0, y, z);
+						const double *const above = sums[l].data(0, y - 1, z);
+						#pragma omp simd
+						for (int x = x0; x < x1; x++) out[x] += above[x];
+					}
+				}
+			}
+		}
+		return sums;
+	}
+
+
+	CImg<> error_map_local(const CImg<> &est, const CImg<> &truth, const char* method, const int window) {
+		// Statistics of the difference over a window x window neighbourhood, clipped at the edges, in constant
+		// time per pixel from summed-area tables. local_z is the summed difference over its Poisson standard
+		// deviation, the square root of the summed truth.
+		if (window < 1) {
+			printf("\nWindow must be at least one pixel.\n");
+			exit(1);
+		}
+		const CImgList<double> sums = error_sums(est, truth);
+		const int width = truth.width(), height = truth.height(), depth = truth.depth();
+		const int before = (window - 1) / 2, after = window / 2;
+		const int statistic = !strcmp(method, "local_rmse") ? 0 : !strcmp(method, "local_bias") ? 1 : !strcmp(method, "local_var") ? 2 : 3;
+		CImg<> errors(width, height, depth, 1);
+
+		#pragma omp parallel for
+		for (int row = 0; row < height * depth; row++) {
+			const int y = row % height, z = row / height;
+			const int y0 = std::max(0, y - before), y1 = std::min(height, y + after + 1);
+			for (int x = 0; x < width; x++) {
+				const int x0 = std::max(0, x - before), x1 = std::min(width, x + after + 1);
+				double s[3];
+				for (int l = 0; l < 3; l++) {
+					s[l] = sums[l](x1, y1, z) - sums[l](x0, y1, z) - sums[l](x1, y0, z) + sums[l](x0, y0, z);
+				}
+				const double n = (double) (x1 - x0) * (y1 - y0), mean = s[0] / n;
+				double v;
+				if (statistic == 0) v = std::sqrt(std::max(0.0, s[1] / n));
+				else if (statistic == 1) v = mean;
+				else if (statistic == 2) v = std::max(0.0, s[1] / n - mean * mean);
+				else v = s[2] > 0 ? s[0] / std::sqrt(s[2]) : 0;
+				errors(x, y, z) = v;
+			}
+		}
+		return errors;
+	}
+
+
+	CImg<> error_map(const CImg<> &est, const CImg<> &truth, const char* method) {
+		return error_map(est, truth, method, 7);
+	}
+
+
+	CImg<> error_map(const CImg<> &est, const CImg<> &truth, const char* method, const int window) {
 		CImg<> errors;
 
 		int start_time = cimg::time();
@@ -22,6 +112,19 @@ namespace fish{
 		if (!strcmp(method, "diff")) {
 			printf("pixel differences method...");
 			errors = error_map_diff(est, truth, method);
+		} else if (!strcmp(method, "deviance")) {
+			printf("Poisson deviance method...");
+			errors = deviance_map(est, truth);
+		} else if (!strcmp(method, "loglik")) {
+			printf("Poisson log-likelihood method...");
+			errors = log_likelihood_map(est, truth);
+		} else if (!strcmp(method, "local_rmse") || !strcmp(method, "local_bias") || !strcmp(method, "local_var") ||
+				   !strcmp(method, "local_z")) {
+			printf("%s method over %d x %d windows...", method, window, window);
+			errors = error_map_local(est, truth, method, window);
+		} else if (!strcmp(method, "ssim")) {
+			printf("structural similarity method...");
+			errors = ssim_map(est, truth);
 		} else {
 			printf("%s method not implemented.\n", method);
 			exit(1);
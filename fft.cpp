@@ -0,0 +1,123 @@
+#include "CImg.h"
+#include "fish.h"
+#include <map>
+#include <memory>
+
+using namespace cimg_library;
+
+
+namespace fish{
+	FFT::FFT(const int width, const int height, const int depth, const int num_threads) :
+		width(width), height(height), depth(depth), size(width * height * depth) {
+		data = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * size);
+		if (!data) {
+			printf("\nFailed to allocate FFT buffer of %d x %d x %d.\n", width, height, depth);
+			exit(1);
+		}
+
+		// FFTW planning is not thread-safe; share CImg's FFT mutex
+		cimg::mutex(12);
+		fftw_plan_with_nthreads(num_threads > 0 ? num_threads : cimg::nb_cpus());
+		if (depth > 1) {
+			plan_forward = fftw_plan_dft_3d(depth, height, width, data, data, FFTW_FORWARD, FFTW_ESTIMATE);
+			plan_backward = fftw_plan_dft_3d(depth, height, width, data, data, FFTW_BACKWARD, FFTW_ESTIMATE);
+		} else {
+			plan_forward = fftw_plan_dft_2d(height, width, data, data, FFTW_FORWARD, FFTW_ESTIMATE);
+			plan_backward = fftw_plan_dft_2d(height, width, data, data, FFTW_BACKWARD, FFTW_ESTIMATE);
+		}
+		cimg::mutex(12, 0);
+	}
+
+
+	FFT::~FFT() {
+		cimg::mutex(12);
+		fftw_destroy_plan(plan_forward);
+		fftw_destroy_plan(plan_backward);
+		cimg::mutex(12, 0);
+		fftw_free(data);
+	}
+
+
+	void FFT::forward() {
+		fftw_execute(plan_forward);
+	}
+
+
+	void FFT::backward() {
+		fftw_execute(plan_backward);
+	}
+
+
+	CImgList<> FFT::get_data() const {
+		CImgList<> f(2, width, height, depth, 1, 0);
+		cimg_foroff(f[0], i) {
+			f[0](i) = data[i][0];
+			f[1](i) = data[i][1];
+		}
+		return f;
+	}
+
+
+	void FFT::set_data(const CImg<> &real) {
+		cimg_foroff(real, i) {
+			data[i][0] = real(i);
+			data[i][1] = 0;
+		}
+	}
+
+
+	RealFFT::RealFFT(const int width, const int height, const int depth, const int num_threads) :
+		width(width), height(height), depth(depth), size(width * height * depth),
+		spectrum_size((width / 2 + 1) * height * depth) {
+		real = (double*) fftw_malloc(sizeof(double) * size);
+		spectrum = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * spectrum_size);
+		if (!real || !spectrum) {
+			printf("\nFailed to allocate FFT buffers of %d x %d x %d.\n", width, height, depth);
+			exit(1);
+		}
+
+		cimg::mutex(12);
+		fftw_plan_with_nthreads(num_threads > 0 ? num_threads : cimg::nb_cpus());
+		if (depth > 1) {
+			plan_forward = fftw_plan_dft_r2c_3d(depth, height, width, real, spectrum, FFTW_ESTIMATE);
+			plan_backward = fftw_plan_dft_c2r_3d(depth, height, width, spectrum, real, FFTW_ESTIMATE);
+		} else {
+			plan_forward = fftw_plan_dft_r2c_2d(height, width, real, spectrum, FFTW_ESTIMATE);
+			plan_backward = fftw_plan_dft_c2r_2d(height, width, spectrum, real, FFTW_ESTIMATE);
+		}
+		cimg::mutex(12, 0);
+	}
+
+
+	RealFFT::~RealFFT() {
+		cimg::mutex(12);
+		fftw_destroy_plan(plan_forward);
+		fftw_destroy_plan(plan_backward);
+		cimg::mutex(12, 0);
+		fftw_free(real);
+		fftw_free(spectrum);
+	}
+
+
+	void RealFFT::forward() {
+		fftw_execute(plan_forward);
+	}
+
+
+	void RealFFT::backward() {
+		// c2r destroys its input, so the spectrum is not valid afterwards
+		fftw_execute(plan_backward);
+	}
+
+
+	RealFFT& real_fft(const int width, const int height, const int depth, const int num_threads) {
+		// One transform per shape, thread count and calling thread, kept for the lifetime of the thread
+		static thread_local std::map<std::pair<long long, int>, std::unique_ptr<RealFFT> > cache;
+		const long long shape = ((long long) depth << 42) | ((long long) height << 21) | width;
+		std::unique_ptr<RealFFT> &f = cache[std::make_pair(shape, num_threads)];
+		if (!f) {
+			f.reset(new RealFFT(width, height, depth, num_threads));
+		}
+		return *f;
+	}
+}
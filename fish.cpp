@@ -1,17 +1,140 @@
 #include "fish.h"
+#include <omp.h>
+#include <map>
+
+std::vector<std::string> split_list(const char* list) {
+	// Comma-separated items
+	std::vector<std::string> items;
+	for (const char* p = list; p; p = strchr(p, ',') ? strchr(p, ',') + 1 : 0) {
+		items.push_back(std::string(p, strchr(p, ',') ? strchr(p, ',') - p : strlen(p)));
+	}
+	return items;
+}
+
+
+int pattern_ints(const char* pattern) {
+	// Number of %d directives in a printf pattern for file names, or -1 if it has any other directive
+	int num_ints = 0;
+	for (const char* p = strchr(pattern, '%'); p; p = strchr(p + 2, '%')) {
+		if (p[1] == 'd') num_ints++;
+		else if (p[1] != '%') return -1;  // Including a trailing %
+	}
+	return num_ints;
+}
+
+
+void save_or_score(CImg<> &img, const char* file_out, const float pitch_xy, const char* file_truth, const char* metrics) {
+	// Write the result and/or score it against the ground truth, so tuning runs need not write it at all. The
+	// truth is streamed in batches of pages and scored against the matching pages of the result as it is read,
+	// so it is never held whole alongside the result.
+	if (file_out) fish::save_tiff(img, file_out, pitch_xy, 0);
+	if (!file_truth) return;
+	fish::MetricAccumulator accumulator(split_list(metrics));
+	const int num_frames = fish::tiff_num_frames(file_truth);
+	if (num_frames != img.depth()) {
+		printf("\nThe result has %d frames and the ground truth %s has %d.\n", img.depth(), file_truth, num_frames);
+		exit(1);
+	}
+	const int batch = std::max(64, omp_get_max_threads());
+	for (int first = 0; first < num_frames; first += batch) {
+		const int last = std::min(first + batch, num_frames) - 1;
+		accumulator.add(img.get_shared_slices(first, last), fish::load_tiff(file_truth, first, last));
+	}
+	accumulator.report();
+}
+
+
+int affine(int argc, char*argv[]) {
+	cimg_help("\nApply a chain of affine transforms in a single resampling pass");
+	
+	const char * file_img = cimg_option("-i", (char*) 0, "input image file");
+	const char * file_out = cimg_option("-o", (char*) 0, "output image file");
+	const char * chain = cimg_option("-c", (char*) 0, "transforms applied in order, e.g. rotate:30,translate:1.5:-2,scale:0.5 (or matrix: and 12 values)");
+	const char* method = cimg_option("-m", "coord", "method [coord, area]");
+	const char * file_truth = cimg_option("-truth", (char*) 0, "ground truth to score the result against (-o is then optional)");
+	const char * metrics = cimg_option("-metrics", "rmse", "metrics for -truth, separated by commas");
+	const bool display =   cimg_option("-display", false, "display transformed image\n");
+	if (!file_img || (!file_out && !file_truth) || !chain) {return 1;}
+
+	CImg<> img = fish::load_tiff(file_img);
+	int width = img.width(), height = img.height(), depth = img.depth();
+	float affmat[16];
+	if (!fish::affine_chain(chain, width, height, depth, affmat)) {
+		printf("\nCould not parse transform chain '%s'.\n", chain);
+		return 1;
+	}
+	img = fish::affine(img, affmat, width, height, depth, method);
+	save_or_score(img, file_out, 0, file_truth, metrics);
+
+	if (display) {
+		img.display("Transformed image", false);
+	}
+	return 0;
+}
+
 
 int dim(int argc, char*argv[]) {
 	cimg_help("\nDim image by factor");
 	
 	const char * file_img = cimg_option("-i", (char*) 0, "input image file");
-	const char * file_out = cimg_option("-o", (char*) 0, "output image file");
+	const char * file_out = cimg_option("-o", (char*) 0, "output image file (with -levels, a printf pattern such as out_%d.tif gives one file per level)");
 	const float scale = cimg_option("-s", 1.0, "scaling factor");
+	const char * levels_str = cimg_option("-levels", (char*) 0, "nested series of scaling factors, e.g. 1,0.5,0.25 (pages of one output unless -o is a pattern)");
+	const char * file_truth = cimg_option("-truth", (char*) 0, "ground truth to score the result against (-o is then optional)");
+	const char * metrics = cimg_option("-metrics", "rmse", "metrics for -truth, separated by commas");
 	const bool display =   cimg_option("-display", false, "display dimmed image\n");
-	if (!file_img || !file_out) {return 1;}
+	if (!file_img || (!file_out && !file_truth)) {return 1;}
+
+	if (levels_str) {
+		if (!file_out) {return 1;}
+		std::vector<float> levels;
+		for (const char* p = levels_str; p; p = strchr(p, ',') ? strchr(p, ',') + 1 : 0) {
+			levels.push_back(atof(p));
+		}
+
+		// Stream page by page, writing each level to its own file, or interleaved as pages of one file
+		const bool per_level = strchr(file_out, '%') != 0;
+		if (per_level && pattern_ints(file_out) != 1) {
+			printf("\nOutput pattern %s must contain a single %%d.\n", file_out);
+			return 1;
+		}
+		const int num_frames = fish::tiff_num_frames(file_img);
+		std::vector<TinyTIFFFile*> tiffs(per_level ? levels.size() : 1);
+		int start_time = cimg::time();
+		printf("\nDimming %d frames to %d nested levels...", num_frames, (int) levels.size());
+		fflush(stdout);
+		// Pages are read in batches, as reopening the file for each one walks its directory chain from the start
+		const int batch = std::max(64, omp_get_max_threads());
+		const unsigned int seed = fish::random_seed();
+		CImg<> pages;
+		for (int frame = 0; frame < num_frames; frame++) {
+			if (frame % batch == 0) pages = fish::load_tiff(file_img, frame, std::min(frame + batch, num_frames) - 1);
+			const CImg<> img = pages.get_slice(frame % batch);
+			fish::set_random_seed(seed + frame);
+			CImgList<> dimmed = fish::dim_series(img, levels);
+			if (frame == 0) {
+				for (size_t k = 0; k < tiffs.size(); k++) {
+					char filename[4096];
+					snprintf(filename, sizeof(filename), file_out, (int) k);
+					tiffs[k] = fish::open_tiff(per_level ? filename : file_out, img.width(), img.height());
+				}
+			}
+			cimglist_for(dimmed, k) {
+				fish::save_tiff_frames(tiffs[per_level ? k : 0], dimmed[k], 0, 0);
+			}
+		}
+		fish::set_random_seed(seed);
+		for (size_t k = 0; k < tiffs.size(); k++) {
+			fish::close_tiff(tiffs[k]);
+		}
+		int dimming_time = cimg::time() - start_time;
+		printf(" (completed in %d ms)\n", dimming_time);
+		return 0;
+	}
 
 	CImg<> img = fish::load_tiff(file_img);
 	img = fish::dim(img, scale);
-	fish::save_tiff(img, file_out, 0, 0);
+	save_or_score(img, file_out, 0, file_truth, metrics);
 
 	if (display) {
 		img.display("Dimmed image", false);
@@ -25,8 +148,38 @@ int error(int argc, char*argv[]) {
 	
 	const char * file_est = cimg_option("-e", (char*) 0, "estimated image file");
 	const char * file_truth = cimg_option("-t", (char*) 0, "ground truth image file");
-	const char* method = cimg_option("-m", (char*) "rmse", "method\n");
+	const char* method = cimg_option("-m", (char*) "rmse", "method [mse, rmse, psnr, deviance, loglik, ssim, ms_ssim], or several separated by commas");
+	const char * file_out = cimg_option("-o", (char*) 0, "per-frame report, as CSV or (for .json) JSON");
+	const bool frames = cimg_option("-frames", false, "report each frame of a stack, streaming the stacks (implied by -o or several methods)");
+	const int num_replicates = cimg_option("-bootstrap", 0, "resample the image in tiles this many times and report the mean and 95% interval of each metric (for the noise of an operation, use pipe -bootstrap)");
+	const int block = cimg_option("-block", 8, "tile size for -bootstrap, at least the correlation length of the errors (1 assumes independent pixels)\n");
 	if (!file_est || !file_truth) {return 1;}
+	if (num_replicates > 0 && block < 1) {
+		printf("\nBootstrap tiles must be at least 1 pixel.\n");
+		return 1;
+	}
+
+	if (num_replicates > 0) {
+		CImg<> est = fish::load_tiff(file_est);
+		CImg<> truth = fish::load_tiff(file_truth);
+		const std::vector<std::string> methods = split_list(method);
+		int start_time = cimg::time();
+		printf("\nBootstrapping %d metric%s over %d replicates...", (int) methods.size(), methods.size() == 1 ? "" : "s", num_replicates);
+		fflush(stdout);
+		std::vector<std::vector<double> > values(methods.size());
+		for (size_t m = 0; m < methods.size(); m++) {
+			values[m] = fish::error_bootstrap(est, truth, methods[m].c_str(), num_replicates, block);
+		}
+		int bootstrap_time = cimg::time() - start_time;
+		printf(" (completed in %d ms)\n", bootstrap_time);
+		for (size_t m = 0; m < methods.size(); m++) fish::bootstrap_report(methods[m].c_str(), values[m]);
+		return 0;
+	}
+
+	if (frames || file_out || strchr(method, ',')) {
+		fish::error_frames(file_est, file_truth, split_list(method), file_out);
+		return 0;
+	}
 
 	CImg<> est = fish::load_tiff(file_est);
 	CImg<> truth = fish::load_tiff(file_truth);
@@ -43,13 +196,14 @@ int error_map(int argc, char*argv[]) {
 	const char * file_est = cimg_option("-e", (char*) 0, "estimated image file");
 	const char * file_truth = cimg_option("-t", (char*) 0, "ground truth image file");
 	const char * file_out = cimg_option("-o", (char*) 0, "output image file");
-	const char* method = cimg_option("-m", (char*) "diff", "method\n");
+	const char* method = cimg_option("-m", (char*) "diff", "method [diff, deviance, loglik, local_rmse, local_bias, local_var, local_z, ssim]");
+	const int window = cimg_option("-w", 7, "window size for local methods\n");
 	const bool display =   cimg_option("-display", false, "display error map\n");
 	if (!file_est || !file_truth) {return 1;}
 
 	CImg<> est = fish::load_tiff(file_est);
 	CImg<> truth = fish::load_tiff(file_truth);
-	CImg<> error = fish::error_map(est, truth, method);
+	CImg<> error = fish::error_map(est, truth, method, window);
 	fish::save_tiff(error, file_out, 0, 0);
 
 	if (display) {
@@ -59,18 +213,109 @@ int error_map(int argc, char*argv[]) {
 }
 
 
+int frc(int argc, char*argv[]) {
+	cimg_help("\nEstimate resolution by Fourier ring correlation between random halves of the photons");
+	
+	const char * file_img = cimg_option("-i", (char*) 0, "input image file (each page is analysed separately, unless -3d)");
+	const char * file_out = cimg_option("-o", (char*) 0, "CSV file for the curves (frame, ring, frequency, mean, std, half_bit)");
+	const int num_splits = cimg_option("-n", 1, "number of independent splits, for error bars");
+	const float pitch = cimg_option("-p", 1.0, "pixel pitch, to report resolution in physical units");
+	const bool volume = cimg_option("-3d", false, "treat a stack as one volume (Fourier shell correlation)\n");
+	if (!file_img || num_splits < 1) {return 1;}
+
+	CImg<> img = fish::load_tiff(file_img);
+	const int num_frames = volume ? 1 : img.depth();
+	const int n = volume && img.depth() > 1 ? std::min(img.width(), std::min(img.height(), img.depth())) : std::min(img.width(), img.height());
+	const char* thresholds[2] = {"1/7", "half_bit"};
+	std::vector<std::vector<double> > curves(num_frames * num_splits), counts(num_frames * num_splits);
+	std::vector<double> resolutions(num_frames * num_splits * 2);
+	const unsigned int seed = fish::random_seed();
+
+	// Each split of each frame is independent, with its own seed. With fewer tasks than threads, the tasks
+	// run one at a time so that their transforms use every thread instead.
+	int start_time = cimg::time();
+	printf("\nCorrelating %d split%s of %d frame%s...", num_splits, num_splits == 1 ? "" : "s", num_frames, num_frames == 1 ? "" : "s");
+	fflush(stdout);
+	const int num_tasks = num_frames * num_splits;
+	#pragma omp parallel for schedule(dynamic) if(num_tasks >= omp_get_max_threads())
+	for (int task = 0; task < num_tasks; task++) {
+		const int frame = task / num_splits;
+		fish::set_random_seed(seed + task);
+		const CImgList<> halves = fish::split(volume ? img : img.get_slice(frame), 0.5);
+		curves[task] = fish::frc(halves[0], halves[1], counts[task]);
+		for (int t = 0; t < 2; t++) {
+			resolutions[task * 2 + t] = fish::frc_resolution(curves[task], counts[task], thresholds[t]);
+		}
+	}
+	fish::set_random_seed(seed);
+	int frc_time = cimg::time() - start_time;
+	printf(" (completed in %d ms)\n", frc_time);
+
+	std::FILE* csv = file_out ? std::fopen(file_out, "w") : 0;
+	if (file_out && !csv) {
+		printf("\nCould not open %s for writing.\n", file_out);
+		return 1;
+	}
+	if (csv) std::fprintf(csv, "frame,ring,frequency,mean,std,half_bit\n");
+	for (int frame = 0; frame < num_frames; frame++) {
+		printf("Frame %d:", frame);
+		for (int t = 0; t < 2; t++) {
+			// Resolution as a period, n / ring pixels; splits that never cross the threshold are left out
+			double sum = 0, sum_sq = 0;
+			int num_crossed = 0;
+			for (int s = 0; s < num_splits; s++) {
+				const double ring = resolutions[(frame * num_splits + s) * 2 + t];
+				if (ring <= 0) continue;
+				const double resolution = n / ring * pitch;
+				sum += resolution;
+				sum_sq += resolution * resolution;
+				num_crossed++;
+			}
+			if (!num_crossed) {
+				printf("  %s: not reached", thresholds[t]);
+				continue;
+			}
+			const double mean = sum / num_crossed;
+			const double std_dev = std::sqrt(std::max(0.0, sum_sq / num_crossed - mean * mean));
+			printf("  %s: %.3f +/- %.3f", thresholds[t], mean, std_dev);
+		}
+		printf("\n");
+
+		if (csv) {
+			const std::vector<double> &ring_counts = counts[frame * num_splits];
+			for (size_t r = 0; r < ring_counts.size(); r++) {
+				double sum = 0, sum_sq = 0;
+				for (int s = 0; s < num_splits; s++) {
+					const double v = curves[frame * num_splits + s][r];
+					sum += v;
+					sum_sq += v * v;
+				}
+				const double mean = sum / num_splits;
+				std::fprintf(csv, "%d,%d,%g,%g,%g,%g\n", frame, (int) r, r / (n * pitch), mean,
+							 std::sqrt(std::max(0.0, sum_sq / num_splits - mean * mean)), fish::frc_threshold(ring_counts[r], "half_bit"));
+			}
+		}
+	}
+	if (csv) std::fclose(csv);
+
+	return 0;
+}
+
+
 int intensify(int argc, char*argv[]) {
 	cimg_help("\nIntensify image by factor");
 	
 	const char * file_img = cimg_option("-i", (char*) 0, "input image file");
 	const char * file_out = cimg_option("-o", (char*) 0, "output image file");
 	const float scale = cimg_option("-s", 1.0, "scaling factor");
+	const char * file_truth = cimg_option("-truth", (char*) 0, "ground truth to score the result against (-o is then optional)");
+	const char * metrics = cimg_option("-metrics", "rmse", "metrics for -truth, separated by commas");
 	const bool display =   cimg_option("-display", false, "display intensified image\n");
-	if (!file_img || !file_out) {return 1;}
+	if (!file_img || (!file_out && !file_truth)) {return 1;}
 
 	CImg<> img = fish::load_tiff(file_img);
 	img = fish::intensify(img, scale);
-	fish::save_tiff(img, file_out, 0, 0);
+	save_or_score(img, file_out, 0, file_truth, metrics);
 
 	if (display) {
 		img.display("Intensified image", false);
@@ -79,18 +324,185 @@ int intensify(int argc, char*argv[]) {
 }
 
 
+bool rebin_factors_valid(const char* method, const int scale, const float scale_x, const float scale_y, const float scale_z) {
+	// Exact rebinning takes any finite positive factors, the other methods a whole scale of at least 1
+	if (strcmp(method, "exact")) {
+		if (scale >= 1) return true;
+		printf("\nRebinning scale must be at least 1 (got %d).\n", scale);
+		return false;
+	}
+	if (std::isfinite(scale_x) && std::isfinite(scale_y) && std::isfinite(scale_z) && scale_x > 0 && scale_y > 0 && scale_z > 0) {
+		return true;
+	}
+	printf("\nRebinning factors must be finite and positive (got %g x %g x %g).\n", scale_x, scale_y, scale_z);
+	return false;
+}
+
+
+int pipe_stage(fish::Graph &graph, const int node, int argc, char* argv[]) {
+	// Add one stage of a pipe, taking the same options as the stand-alone command
+	if (!strcmp(argv[0], "affine")) {
+		const char * chain = cimg_option("-c", (char*) 0, "transforms applied in order");
+		const char* method = cimg_option("-m", "coord", "method [coord, area]");
+		int width = graph.nodes[node].width, height = graph.nodes[node].height, depth = graph.nodes[node].depth;
+		float affmat[16];
+		if (!chain || !fish::affine_chain(chain, width, height, depth, affmat)) {
+			printf("\nCould not parse transform chain '%s'.\n", chain ? chain : "");
+			return -1;
+		}
+		return graph.affine(node, affmat, width, height, depth, method);
+	} else if (!strcmp(argv[0], "dim")) {
+		return graph.dim(node, cimg_option("-s", 1.0, "scaling factor"));
+	} else if (!strcmp(argv[0], "poissonify")) {
+		return graph.poissonify(node, cimg_option("-s", 1.0, "pre-scaling factor"));
+	} else if (!strcmp(argv[0], "rebin")) {
+		const int scale = cimg_option("-s", 2, "scaling factor");
+		const char* direction = cimg_option("-m", (char*) 0, "method");
+		const float scale_x = cimg_option("-sx", (float) scale, "exact method: new pixel width");
+		const float scale_y = cimg_option("-sy", scale_x, "exact method: new pixel height");
+		const float scale_z = cimg_option("-sz", 1.0f, "exact method: new pixel depth");
+		if (!direction) {
+			printf("\nrebin needs a method (-m).\n");
+			return -1;
+		}
+		if (!rebin_factors_valid(direction, scale, scale_x, scale_y, scale_z)) return -1;
+		if (!strcmp(direction, "exact")) return graph.rebin(node, scale_x, scale_y, scale_z);
+		return graph.rebin(node, scale, direction);
+	} else if (!strcmp(argv[0], "rotate")) {
+		return graph.rotate(node, cimg_option("-a", 45.0, "rotation angle (degrees)"), cimg_option("-m", "coord", "method"));
+	} else if (!strcmp(argv[0], "scale")) {
+		return graph.scale(node, cimg_option("-pi", 0.0, "pixel pitch in"), cimg_option("-po", 0.0, "pixel pitch out"));
+	} else if (!strcmp(argv[0], "translate")) {
+		const float shift_x = cimg_option("-x", 0.0, "shift in x");
+		const float shift_y = cimg_option("-y", 0.0, "shift in y");
+		return graph.translate(node, shift_x, shift_y, cimg_option("-m", "coord", "method"));
+	}
+	printf("\nCommand %s cannot be used in a pipe.\n", argv[0]);
+	return -1;
+}
+
+
+int pipe_first_stage(int argc, char* argv[], const char* value_options) {
+	// The command's own options come before the first stage; those in value_options take a value
+	const std::string options = std::string(" ") + value_options + " ";
+	int k = 2;
+	while (k < argc && argv[k][0] == '-') {
+		k += options.find(std::string(" ") + argv[k] + " ") != std::string::npos ? 2 : 1;
+	}
+	return std::min(k, argc);
+}
+
+
+int pipe(int argc, char* argv[]) {
+	cimg_help("\nRun a chain of commands in memory, e.g. fish pipe -i in.tif -o out.tif dim -s 0.5 : rotate -a 30 : rebin -m down -s 2\n"
+			  " Stages take the options of the stand-alone commands (affine, dim, poissonify, rebin, rotate, scale, translate)");
+
+	const int first_stage = pipe_first_stage(argc, argv, "-i -o -truth -metrics -bootstrap");
+	const int pipe_argc = first_stage;
+	const char * file_img = cimg::option("-i", pipe_argc, argv, (char*) 0, "input image file");
+	const char * file_out = cimg::option("-o", pipe_argc, argv, (char*) 0, "output image file");
+	const char * file_truth = cimg::option("-truth", pipe_argc, argv, (char*) 0, "ground truth to score each page against (-o is then optional)");
+	const char * metrics = cimg::option("-metrics", pipe_argc, argv, "rmse", "metrics for -truth, separated by commas");
+	const int num_replicates = cimg::option("-bootstrap", pipe_argc, argv, 0, "run the chain this many times with different seeds and report the mean and 95% interval of each metric (needs -truth; -o gets the first run)");
+	const bool volume = cimg::option("-volume", pipe_argc, argv, false, "process stacks as one volume rather than page by page\n");
+	if (!file_img || (!file_out && !file_truth) || first_stage >= argc || (num_replicates && !file_truth)) {return 1;}
+
+	// Pages are streamed through the chain, each with its own random seed, so only the final output is written.
+	// Replicates run side by side, with the threads left over for their kernels, and are scored page by page.
+	const int num_frames = volume ? 1 : fish::tiff_num_frames(file_img);
+	const unsigned int seed = fish::random_seed();
+	const int num_runs = std::max(1, num_replicates);
+	const int num_threads = omp_get_max_threads(), outer = std::min(num_runs, num_threads);
+	const int nested = omp_get_max_active_levels();
+	TinyTIFFFile* tiff = 0;
+	std::vector<fish::MetricAccumulator> accumulators(num_runs, fish::MetricAccumulator(file_truth ? split_list(metrics) : std::vector<std::string>()));
+
+	// The chain is built once and each page swapped in as its input, unless a page differs in shape or is
+	// not photon counts where the first was, which the folds may rely on
+	fish::Graph graph;
+	int input = -1, node = -1;
+	auto build = [&](const CImg<> &page) {
+		graph = fish::Graph();
+		input = node = graph.input(page);
+		for (int k = first_stage; k < argc && node >= 0; k++) {
+			int stage_argc = 0;
+			while (k + stage_argc < argc && strcmp(argv[k + stage_argc], ":")) stage_argc++;
+			node = stage_argc ? pipe_stage(graph, node, stage_argc, argv + k) : -1;
+			k += stage_argc;
+		}
+		if (node >= 0) graph.optimize();
+		return node >= 0;
+	};
+
+	// Pages are read in batches, as reopening the file for each one walks its directory chain from the start
+	const int batch = std::max(64, omp_get_max_threads());
+	CImg<> pages, truth_pages;
+	int start_time = cimg::time();
+	for (int frame = 0; frame < num_frames; frame++) {
+		if (frame % batch == 0) {
+			const int last = std::min(frame + batch, num_frames) - 1;
+			pages = volume ? fish::load_tiff(file_img) : fish::load_tiff(file_img, frame, last);
+			if (file_truth) truth_pages = volume ? fish::load_tiff(file_truth) : fish::load_tiff(file_truth, frame, last);
+		}
+		const CImg<> page = volume ? pages : pages.get_slice(frame % batch);
+		if (frame == 0 || !graph.set_input(input, page)) {
+			if (!build(page)) {
+				if (tiff) fish::close_tiff(tiff);
+				return 1;
+			}
+		}
+		if (frame == 0) printf("\nPipeline: %s\n", graph.describe(node).c_str());
+
+		const CImg<> truth = file_truth ? (volume ? truth_pages : truth_pages.get_slice(frame % batch)) : CImg<>();
+		CImg<> img;
+		omp_set_max_active_levels(2);
+		#pragma omp parallel for num_threads(outer) schedule(dynamic)
+		for (int run = 0; run < num_runs; run++) {
+			omp_set_num_threads(std::max(1, num_threads / outer));
+			fish::Graph replicate = graph;
+			fish::set_random_seed(seed + (unsigned int) run * num_frames + frame);
+			CImg<> out = replicate.evaluate(node);
+			if (file_truth) accumulators[run].add(out, truth);
+			if (run == 0) img.swap(out);
+		}
+		omp_set_max_active_levels(nested);
+		if (!file_out) continue;
+		if (!tiff) tiff = fish::open_tiff(file_out, img.width(), img.height());
+		fish::save_tiff_frames(tiff, img, 0, 0);
+	}
+	fish::set_random_seed(seed);
+	if (tiff) fish::close_tiff(tiff);
+	int pipe_time = cimg::time() - start_time;
+	printf("Processed %d frame%s in %d ms\n", num_frames, num_frames == 1 ? "" : "s", pipe_time);
+	if (num_replicates) {
+		const std::vector<std::string> &methods = accumulators[0].methods;
+		for (size_t m = 0; m < methods.size(); m++) {
+			std::vector<double> values(num_runs);
+			for (int run = 0; run < num_runs; run++) values[run] = accumulators[run].value(m);
+			fish::bootstrap_report(methods[m].c_str(), values);
+		}
+	} else if (file_truth) {
+		accumulators[0].report();
+	}
+
+	return 0;
+}
+
+
 int poissonify(int argc, char* argv[]) {
 	cimg_help("\nAdd Poisson noise to image");
 	
 	const char * file_img = cimg_option("-i", (char*) 0, "input image file");
 	const char * file_out = cimg_option("-o", (char*) 0, "output image file");
 	const float scale = cimg_option("-s", 1.0, "pre-scaling factor");
+	const char * file_truth = cimg_option("-truth", (char*) 0, "ground truth to score the result against (-o is then optional)");
+	const char * metrics = cimg_option("-metrics", "rmse", "metrics for -truth, separated by commas");
 	const bool display =   cimg_option("-display", false, "display Poissonified image\n");
-	if (!file_img || !file_out) {return 1;}
+	if (!file_img || (!file_out && !file_truth)) {return 1;}
 
 	CImg<> img = fish::load_tiff(file_img);
 	img = fish::poissonify(img, scale);
-	fish::save_tiff(img, file_out, 0, 0);
+	save_or_score(img, file_out, 0, file_truth, metrics);
 
 	if (display) {
 		img.display("Poissonified image", false);
@@ -105,13 +517,23 @@ int rebin(int argc, char* argv[]) {
 	const char * file_img = cimg_option("-i", (char*) 0, "input image file");
 	const char * file_out = cimg_option("-o", (char*) 0, "output image file");
 	const int scale = cimg_option("-s", 2, "scaling factor");
-	const char* direction = cimg_option("-m", (char*) 0, "method [down, up_nn, up_fourier, up_fourier_poisson, up_thin_nn, up_thin_fourier, up_thin_fourier_poisson]");
+	const char* direction = cimg_option("-m", (char*) 0, "method [down, exact, up_nn, up_fourier, up_fourier_poisson, up_thin_nn, up_thin_fourier, up_thin_fourier_poisson]");
+	const float scale_x = cimg_option("-sx", (float) scale, "exact method: new pixel width, in input pixels (may be fractional)");
+	const float scale_y = cimg_option("-sy", scale_x, "exact method: new pixel height, in input pixels");
+	const float scale_z = cimg_option("-sz", 1.0f, "exact method: new pixel depth, in input pixels");
+	const char * file_truth = cimg_option("-truth", (char*) 0, "ground truth to score the result against (-o is then optional)");
+	const char * metrics = cimg_option("-metrics", "rmse", "metrics for -truth, separated by commas");
 	const bool display =   cimg_option("-display", false, "display rebinned image\n");
-	if (!file_img || !file_out) {return 1;}
+	if (!file_img || (!file_out && !file_truth) || !direction) {return 1;}
+	if (!rebin_factors_valid(direction, scale, scale_x, scale_y, scale_z)) {return 1;}
 
 	CImg<> img = fish::load_tiff(file_img);
-	img = fish::rebin(img, scale, direction);
-	fish::save_tiff(img, file_out, 0, 0);
+	if (!strcmp(direction, "exact")) {
+		img = fish::rebin(img, scale_x, scale_y, scale_z);
+	} else {
+		img = fish::rebin(img, scale, direction);
+	}
+	save_or_score(img, file_out, 0, file_truth, metrics);
 
 	if (display) {
 		img.display("Rebinned image", false);
@@ -128,13 +550,15 @@ int rebin_rl(int argc, char* argv[]) {
 	const char * file_out = cimg_option("-o", (char*) 0, "output image file");
 	const int scale = cimg_option("-s", 2, "scaling factor");
 	const int num_iters = cimg_option("-n", 10, "number of iterations");
+	const char * file_truth = cimg_option("-truth", (char*) 0, "ground truth to score the result against (-o is then optional)");
+	const char * metrics = cimg_option("-metrics", "rmse", "metrics for -truth, separated by commas");
 	const bool display =   cimg_option("-display", false, "display rebinned image\n");
-	if (!file_img || !file_out || !file_psf) {return 1;}
+	if (!file_img || (!file_out && !file_truth) || !file_psf) {return 1;}
 
 	CImg<> img = fish::load_tiff(file_img);
 	CImg<> psf = fish::load_tiff(file_psf);
 	img = fish::rebin_rl(img, scale, psf, num_iters);
-	fish::save_tiff(img, file_out, 0, 0);
+	save_or_score(img, file_out, 0, file_truth, metrics);
 
 	if (display) {
 		img.display("Rebinned image", false);
@@ -143,6 +567,52 @@ int rebin_rl(int argc, char* argv[]) {
 }
 
 
+int rebin_rl_batch(int argc, char* argv[]) {
+	cimg_help("\nRebin many images sharing one PSF with rebin_rl, reusing the OTFs between frames");
+	
+	const char * file_list = cimg_option("-l", (char*) 0, "text file listing input images (one per line, optionally followed by an output path); every page of a stack is rebinned");
+	const char * file_psf = cimg_option("-p", (char*) 0, "PSF image file");
+	const char * dir_out = cimg_option("-o", (char*) 0, "output directory (for inputs without an output path)");
+	const char * dir_cache = cimg_option("-c", (char*) 0, "OTF cache directory");
+	const int scale = cimg_option("-s", 2, "scaling factor");
+	const int num_iters = cimg_option("-n", 10, "number of iterations");
+	const int num_threads = cimg_option("-t", 0, "number of threads (0 for all)\n");
+	if (!file_list || !file_psf) {return 1;}
+
+	std::vector<std::string> files_in, files_out;
+	std::FILE* list = std::fopen(file_list, "r");
+	if (!list) {
+		printf("\nCould not open list file %s.\n", file_list);
+		return 1;
+	}
+	char line[4096], file_in[2048], file_out[2048];
+	while (std::fgets(line, sizeof(line), list)) {
+		const int num_fields = sscanf(line, "%2047s %2047s", file_in, file_out);
+		if (num_fields < 1) continue;
+		if (num_fields < 2) {
+			if (!dir_out) {
+				printf("\nNo output path for %s and no output directory given.\n", file_in);
+				std::fclose(list);
+				return 1;
+			}
+			snprintf(file_out, sizeof(file_out), "%s/%s", dir_out, cimg::basename(file_in));
+		}
+		files_in.push_back(file_in);
+		files_out.push_back(file_out);
+	}
+	std::fclose(list);
+
+	if (num_threads > 0) omp_set_num_threads(num_threads);
+	CImg<> psf = fish::load_tiff(file_psf);
+	int start_time = cimg::time();
+	fish::rebin_rl_batch(files_in, files_out, scale, psf, num_iters, dir_cache);
+	int batch_time = cimg::time() - start_time;
+	printf("Rebinned %d images in %d ms\n", (int) files_in.size(), batch_time);
+
+	return 0;
+}
+
+
 int rotate(int argc, char*argv[]) {
 	cimg_help("\nRotate image by angle");
 	
@@ -150,12 +620,60 @@ int rotate(int argc, char*argv[]) {
 	const char * file_out = cimg_option("-o", (char*) 0, "output image file");
 	const float angle = cimg_option("-a", 45.0, "rotation angle (degrees)");
 	const char* method = cimg_option("-m", "coord", "method [coord, nn]");
+	const char* axis_str = cimg_option("-axis", (char*) 0, "rotation axis for volumes, as x,y,z (default 0,0,1)");
+	const char* centre_str = cimg_option("-centre", (char*) 0, "centre of rotation for volumes, as x,y,z (default image centre)");
+	const int slab = cimg_option("-slab", 0, "stream volumes through in slabs of this many slices (0 loads the whole volume)");
+	const char* sweep = cimg_option("-sweep", (char*) 0, "render angles start:stop:step (stop excluded) as pages of one output file");
+	const char * file_truth = cimg_option("-truth", (char*) 0, "ground truth to score the result against (-o is then optional)");
+	const char * metrics = cimg_option("-metrics", "rmse", "metrics for -truth, separated by commas");
 	const bool display =   cimg_option("-display", false, "display rotated image\n");
-	if (!file_img || !file_out) {return 1;}
+	if (!file_img || (!file_out && !file_truth)) {return 1;}
+
+	float axis[3] = {0, 0, 1}, centre[3];
+	if (axis_str && sscanf(axis_str, "%f,%f,%f", &axis[0], &axis[1], &axis[2]) != 3) {
+		printf("\nCould not parse axis '%s'.\n", axis_str);
+		return 1;
+	}
+	if (centre_str && sscanf(centre_str, "%f,%f,%f", &centre[0], &centre[1], &centre[2]) != 3) {
+		printf("\nCould not parse centre '%s'.\n", centre_str);
+		return 1;
+	}
+
+	if ((sweep || slab > 0) && !file_out) {return 1;}
+	if (sweep) {
+		float start, stop, step;
+		if (sscanf(sweep, "%f:%f:%f", &start, &stop, &step) != 3 || step == 0) {
+			printf("\nCould not parse sweep '%s'.\n", sweep);
+			return 1;
+		}
+		CImg<> img = fish::load_tiff(file_img);
+		fish::rotate_sweep(img, start, stop, step, method, file_out);
+		return 0;
+	}
+
+	if (slab > 0) {
+		if (!centre_str) {
+			CImg<> first = fish::load_tiff(file_img, 0, 0);
+			centre[0] = first.width() / 2.0f;
+			centre[1] = first.height() / 2.0f;
+			centre[2] = fish::tiff_num_frames(file_img) / 2.0f;
+		}
+		fish::rotate3d(file_img, file_out, angle, axis, centre, method, slab);
+		return 0;
+	}
 
 	CImg<> img = fish::load_tiff(file_img);
-	img = fish::rotate(img, angle, method);
-	fish::save_tiff(img, file_out, 0, 0);
+	if (img.depth() > 1 || axis_str) {
+		if (!centre_str) {
+			centre[0] = img.width() / 2.0f;
+			centre[1] = img.height() / 2.0f;
+			centre[2] = img.depth() / 2.0f;
+		}
+		img = fish::rotate3d(img, angle, axis, centre, method);
+	} else {
+		img = fish::rotate(img, angle, method);
+	}
+	save_or_score(img, file_out, 0, file_truth, metrics);
 
 	if (display) {
 		img.display("Rotated image", false);
@@ -171,12 +689,14 @@ int scale(int argc, char*argv[]) {
 	const char * file_out = cimg_option("-o", (char*) 0, "output image file");
 	const float pin = cimg_option("-pi", 0.0, "pixel pitch in");
 	const float pout = cimg_option("-po", 0.0, "pixel pitch out");
+	const char * file_truth = cimg_option("-truth", (char*) 0, "ground truth to score the result against (-o is then optional)");
+	const char * metrics = cimg_option("-metrics", "rmse", "metrics for -truth, separated by commas");
 	const bool display =   cimg_option("-display", false, "display rescaled image\n");
-	if (!file_img || !file_out) {return 1;}
+	if (!file_img || (!file_out && !file_truth)) {return 1;}
 
 	CImg<> img = fish::load_tiff(file_img);
 	img = fish::scale(img, pin, pout);
-	fish::save_tiff(img, file_out, pout, 0);
+	save_or_score(img, file_out, pout, file_truth, metrics);
 
 	if (display) {
 		img.display("Rescaled image", false);
@@ -204,6 +724,228 @@ int split(int argc, char*argv[]) {
 }
 
 
+int stats(int argc, char*argv[]) {
+	cimg_help("\nCheck that an image holds photon counts: histogram, index of dispersion, non-integers and the narrowest type");
+
+	const char * file_img = cimg_option("-i", (char*) 0, "input image file (stacks are streamed)");
+	const char * file_out = cimg_option("-o", (char*) 0, "output JSON file (default stdout)\n");
+	if (!file_img) {return 1;}
+
+	int start_time = cimg::time();
+	const fish::ImageStats image_stats = fish::image_stats(file_img);
+	int stats_time = cimg::time() - start_time;
+	// Without -o, stdout holds only the JSON
+	if (file_out) printf("\nCalculated statistics of %ld pixels in %d ms\n", image_stats.num_pixels, stats_time);
+
+	std::FILE *out = file_out ? std::fopen(file_out, "w") : stdout;
+	if (!out) {
+		printf("\nCould not open %s for writing.\n", file_out);
+		return 1;
+	}
+	image_stats.report_json(out);
+	if (file_out) std::fclose(out);
+
+	return 0;
+}
+
+
+int sweep(int argc, char* argv[]) {
+	cimg_help("\nRun a pipe over a grid of parameters, e.g. fish sweep -i in.tif -truth truth.tif -n 8 dim -s {1,0.5} : rotate -a {0,15,30}\n"
+			  " Values in braces (or given in a grid file) are swept; every combination is a point of the grid, run -n times");
+
+	const int first_stage = pipe_first_stage(argc, argv, "-i -o -truth -metrics -n -save -g");
+	const char * file_img = cimg::option("-i", first_stage, argv, (char*) 0, "input image file");
+	const char * file_out = cimg::option("-o", first_stage, argv, (char*) 0, "results table (CSV, default stdout)");
+	const char * file_truth = cimg::option("-truth", first_stage, argv, (char*) 0, "ground truth to score each result against");
+	const char * metrics = cimg::option("-metrics", first_stage, argv, "rmse", "metrics for -truth, separated by commas");
+	const int num_realizations = cimg::option("-n", first_stage, argv, 1, "noise realizations per point");
+	const char * save_pattern = cimg::option("-save", first_stage, argv, (char*) 0, "also save each result, with a printf pattern taking the point and realization, e.g. out_%d_%d.tif");
+	const char * file_grid = cimg::option("-g", first_stage, argv, (char*) 0, "grid file with lines such as 'rotate -a 0,15,30'\n");
+	if (!file_img || (!file_truth && !save_pattern) || first_stage >= argc || num_realizations < 1) {return 1;}
+	if (save_pattern && pattern_ints(save_pattern) != 2) {
+		printf("\nSave pattern %s must contain two %%d, for the point and the realization.\n", save_pattern);
+		return 1;
+	}
+	const std::vector<std::string> methods = file_truth ? split_list(metrics) : std::vector<std::string>();
+	for (size_t m = 0; m < methods.size(); m++) {
+		if (!fish::error_description(methods[m].c_str())) {
+			printf("\n%s method not implemented.\n", methods[m].c_str());
+			return 1;
+		}
+	}
+
+	// Stages as token lists, so that swept values can be substituted
+	std::vector<std::vector<std::string> > stages(1);
+	for (int k = first_stage; k < argc; k++) {
+		if (!strcmp(argv[k], ":")) stages.push_back(std::vector<std::string>());
+		else stages.back().push_back(argv[k]);
+	}
+	if (file_grid) {
+		std::FILE *grid = std::fopen(file_grid, "r");
+		if (!grid) {
+			printf("\nCould not open grid file %s.\n", file_grid);
+			return 1;
+		}
+		char stage_name[64], option[64], values[4096];
+		while (std::fscanf(grid, " %63s %63s %4095s", stage_name, option, values) == 3) {
+			size_t s = 0;
+			while (s < stages.size() && (stages[s].empty() || stages[s][0] != stage_name)) s++;
+			if (s == stages.size()) {
+				printf("\nGrid file names stage %s, which is not in the pipe.\n", stage_name);
+				std::fclose(grid);
+				return 1;
+			}
+			size_t t = 1;
+			while (t + 1 < stages[s].size() && stages[s][t] != option) t++;
+			if (t + 1 >= stages[s].size()) {
+				stages[s].push_back(option);
+				stages[s].push_back("");
+				t = stages[s].size() - 2;
+			}
+			stages[s][t + 1] = std::string("{") + values + "}";
+		}
+		std::fclose(grid);
+	}
+
+	// Axes of the grid, in the order given; the last varies fastest
+	struct Axis {
+		size_t stage, token;
+		std::string name;
+		std::vector<std::string> values;
+	};
+	std::vector<Axis> axes;
+	int num_points = 1;
+	for (size_t s = 0; s < stages.size(); s++) {
+		for (size_t t = 0; t < stages[s].size(); t++) {
+			const std::string &token = stages[s][t];
+			if (token.size() < 2 || token[0] != '{' || token[token.size() - 1] != '}') continue;
+			Axis axis;
+			axis.stage = s;
+			axis.token = t;
+			axis.name = stages[s][0] + (t ? stages[s][t - 1] : std::string());
+			axis.values = split_list(token.substr(1, token.size() - 2).c_str());
+			num_points *= axis.values.size();
+			axes.push_back(axis);
+		}
+	}
+
+	// Without -o, stdout holds only the table; the progress of the sweep and its kernels goes to stderr
+	const int saved_stdout = file_out ? -1 : fish::redirect_stdout(2);
+
+	// One graph for the whole grid: points sharing a prefix of stages share its nodes, which are then
+	// evaluated once per realization
+	const CImg<> img = fish::load_tiff(file_img);
+	fish::Graph graph;
+	const int input = graph.input(img);
+	std::map<std::pair<int, std::string>, int> added;
+	std::vector<int> outputs(num_points);
+	for (int p = 0; p < num_points; p++) {
+		std::vector<std::vector<std::string> > point_stages = stages;
+		for (int a = axes.size() - 1, rest = p; a >= 0; a--) {
+			point_stages[axes[a].stage][axes[a].token] = axes[a].values[rest % axes[a].values.size()];
+			rest /= axes[a].values.size();
+		}
+		int node = input;
+		for (size_t s = 0; s < point_stages.size(); s++) {
+			std::string key;
+			std::vector<char*> stage_argv;
+			for (size_t t = 0; t < point_stages[s].size(); t++) {
+				key += point_stages[s][t] + " ";
+				stage_argv.push_back(const_cast<char*>(point_stages[s][t].c_str()));
+			}
+			if (stage_argv.empty()) {
+				fish::restore_stdout(saved_stdout);
+				return 1;
+			}
+			std::map<std::pair<int, std::string>, int>::const_iterator it = added.find(std::make_pair(node, key));
+			if (it != added.end()) {
+				node = it->second;
+				continue;
+			}
+			const int stage_node = pipe_stage(graph, node, stage_argv.size(), &stage_argv[0]);
+			if (stage_node < 0) {
+				fish::restore_stdout(saved_stdout);
+				return 1;
+			}
+			added[std::make_pair(node, key)] = stage_node;
+			node = stage_node;
+		}
+		outputs[p] = node;
+	}
+	graph.optimize();
+	printf("\nSweeping %d point%s x %d realization%s\n", num_points, num_points == 1 ? "" : "s",
+		   num_realizations, num_realizations == 1 ? "" : "s");
+
+	// Realizations run side by side, each over the whole grid with its own copy of the graph and the
+	// threads left over; each reuses the seed of the same realization in every point
+	const CImg<> truth = file_truth ? fish::load_tiff(file_truth) : CImg<>();
+	std::vector<double> values((long) num_realizations * num_points * methods.size());
+	const unsigned int seed = fish::random_seed();
+	const int num_threads = omp_get_max_threads(), outer = std::min(num_realizations, num_threads);
+	const int nested = omp_get_max_active_levels();
+	omp_set_max_active_levels(2);
+	int start_time = cimg::time();
+	#pragma omp parallel for num_threads(outer) schedule(dynamic)
+	for (int r = 0; r < num_realizations; r++) {
+		omp_set_num_threads(std::max(1, num_threads / outer));
+		fish::Graph realization = graph;
+		for (int p = 0; p < num_points; p++) {
+			fish::set_random_seed(seed + r);
+			CImg<> result = realization.evaluate(outputs[p]);
+			if (save_pattern) {
+				char file_result[4096];
+				snprintf(file_result, sizeof(file_result), save_pattern, p, r);
+				fish::save_tiff(result, file_result, 0, 0);
+			}
+			if (!file_truth) continue;
+			fish::MetricAccumulator accumulator(methods);
+			accumulator.add(result, truth);
+			for (size_t m = 0; m < methods.size(); m++) {
+				values[((long) r * num_points + p) * methods.size() + m] = accumulator.value(m);
+			}
+		}
+	}
+	omp_set_max_active_levels(nested);
+	fish::set_random_seed(seed);
+	int sweep_time = cimg::time() - start_time;
+	printf("Swept %d point%s in %d ms\n", num_points, num_points == 1 ? "" : "s", sweep_time);
+	fish::restore_stdout(saved_stdout);
+	if (!file_truth) return 0;
+
+	// One row per point and realization, followed by the mean over realizations
+	std::FILE *table = file_out ? std::fopen(file_out, "w") : stdout;
+	if (!table) {
+		printf("\nCould not open %s for writing.\n", file_out);
+		return 1;
+	}
+	std::fprintf(table, "point,realization");
+	for (size_t a = 0; a < axes.size(); a++) std::fprintf(table, ",%s", axes[a].name.c_str());
+	for (size_t m = 0; m < methods.size(); m++) std::fprintf(table, ",%s", methods[m].c_str());
+	std::fprintf(table, "\n");
+	for (int p = 0; p < num_points; p++) {
+		std::vector<double> means(methods.size(), 0.0);
+		for (int r = 0; r <= num_realizations; r++) {
+			if (r < num_realizations) std::fprintf(table, "%d,%d", p, r);
+			else std::fprintf(table, "%d,mean", p);
+			for (size_t a = 0, stride = num_points; a < axes.size(); a++) {
+				stride /= axes[a].values.size();
+				std::fprintf(table, ",%s", axes[a].values[p / stride % axes[a].values.size()].c_str());
+			}
+			for (size_t m = 0; m < methods.size(); m++) {
+				const double v = r < num_realizations ? values[((long) r * num_points + p) * methods.size() + m]
+													  : means[m] / num_realizations;
+				if (r < num_realizations) means[m] += v;
+				std::fprintf(table, ",%g", v);
+			}
+			std::fprintf(table, "\n");
+		}
+	}
+	if (file_out) std::fclose(table);
+
+	return 0;
+}
+
+
 int translate(int argc, char*argv[]) {
 	cimg_help("\nTranslate image with sub-pixel precision");
 	
@@ -211,13 +953,27 @@ int translate(int argc, char*argv[]) {
 	const char * file_out = cimg_option("-o", (char*) 0, "output image file");
 	const float shift_x = cimg_option("-x", 0.0, "shift in x");
 	const float shift_y = cimg_option("-y", 0.0, "shift in y");
-	const char* method = cimg_option("-m", "coord", "method [coord, binomial]");
+	const char* method = cimg_option("-m", "coord", "method [coord, binomial, fourier, area]");
+	const char* file_traj = cimg_option("-traj", (char*) 0, "CSV of frame,x,y[,angle] applied per frame of a stack (rotation first, about the frame centre; coord and area only)");
+	const char * file_truth = cimg_option("-truth", (char*) 0, "ground truth to score the result against (-o is then optional)");
+	const char * metrics = cimg_option("-metrics", "rmse", "metrics for -truth, separated by commas");
 	const bool display =   cimg_option("-display", false, "display translated image\n");
-	if (!file_img || !file_out) {return 1;}
+	if (!file_img || (!file_out && !file_truth)) {return 1;}
+
+	if (file_traj) {
+		if (!file_out) {return 1;}
+		std::vector<float> traj_x, traj_y, traj_angle;
+		if (!fish::load_trajectory(file_traj, fish::tiff_num_frames(file_img), traj_x, traj_y, traj_angle)) {
+			printf("\nCould not read trajectory %s.\n", file_traj);
+			return 1;
+		}
+		fish::translate_trajectory(file_img, file_out, traj_x, traj_y, traj_angle, method);
+		return 0;
+	}
 
 	CImg<> img = fish::load_tiff(file_img);
 	img = fish::translate(img, shift_x, shift_y, method);
-	fish::save_tiff(img, file_out, 0, 0);
+	save_or_score(img, file_out, 0, file_truth, metrics);
 
 	if (display) {
 		img.display("Translated image", false);
@@ -226,6 +982,49 @@ int translate(int argc, char*argv[]) {
 }
 
 
+int warp(int argc, char*argv[]) {
+	cimg_help("\nWarp image by a displacement field, conserving photons");
+	
+	const char * file_img = cimg_option("-i", (char*) 0, "input image file");
+	const char * file_field = cimg_option("-f", (char*) 0, "displacement field, dx and dy as two pages of the same size as the input");
+	const char * file_out = cimg_option("-o", (char*) 0, "output image file");
+	const char* method = cimg_option("-m", "area", "method [coord, area]");
+	const char * file_truth = cimg_option("-truth", (char*) 0, "ground truth to score the result against (-o is then optional)");
+	const char * metrics = cimg_option("-metrics", "rmse", "metrics for -truth, separated by commas");
+	const bool display =   cimg_option("-display", false, "display warped image\n");
+	if (!file_img || !file_field || (!file_out && !file_truth)) {return 1;}
+
+	CImg<> img = fish::load_tiff(file_img);
+	CImg<> field = fish::load_tiff(file_field);
+	img = fish::warp(img, field, method);
+	save_or_score(img, file_out, 0, file_truth, metrics);
+
+	if (display) {
+		img.display("Warped image", false);
+	}
+	return 0;
+}
+
+
+int run(int argc, char* argv[]);
+
+
+int serve(int argc, char* argv[]) {
+	cimg_help("\nServe commands from one long-lived process over a Unix socket\n"
+			  " Each line sent is a command and its options, e.g. rotate -i in.tif -o out.tif -a 30, answered with\n"
+			  " \"ok <ms>\" or \"error <status>\"; \"quit\" stops the server. Images may be given as shm:/name to pass\n"
+			  " them through shared memory (four ints width, height, depth, spectrum, then float data)");
+	
+	const char * socket_path = cimg_option("-socket", cimg_option("--socket", (char*) 0, 0), "socket path");
+	const int cache_mb = cimg_option("-cache", 1024, "memory kept for loaded images (MB)\n");
+	if (!socket_path) {return 1;}
+
+	fish::set_image_cache((size_t) cache_mb << 20);
+	fish::serve(socket_path, run);
+	return 0;
+}
+
+
 int show(int argc, char* argv[]) {
 	cimg_help("\nDisplay image");
 	CImg<> img = fish::load_tiff(argv[2]);
@@ -235,51 +1034,79 @@ int show(int argc, char* argv[]) {
 }
 
 
-int main(int argc, char* argv[]) {
+int run(int argc, char* argv[]) {
 	if (argc == 1) {
 		printf("\nfish [command] [options] \n\n"
 			   "Use one of the following commands:\n"
 			   "  show\n"
 			   "  dim\n"
 			   "  affine\n"
+			   "  frc\n"
 			   "  intensify\n"
+			   "  pipe\n"
 			   "  poissonify\n"
 			   "  rotate\n"
 			   "  scale\n"
+			   "  serve\n"
+			   "  stats\n"
+			   "  sweep\n"
 			   "  translate\n"
+			   "  warp\n"
 			   "Use -h as an option to learn about each command.\n\n");
 		return 0;
 	}
 
 	if (!strcmp(argv[1], "-h")) {
-		main(1, argv);
+		run(1, argv);
+	} else if (!strcmp(argv[1], "affine")) {
+		return affine(argc, argv);
 	} else if (!strcmp(argv[1], "dim")) {
 		return dim(argc, argv);
 	} else if (!strcmp(argv[1], "error")) {
 		return error(argc, argv);
 	} else if (!strcmp(argv[1], "error_map")) {
 		return error_map(argc, argv);
+	} else if (!strcmp(argv[1], "frc")) {
+		return frc(argc, argv);
 	} else if (!strcmp(argv[1], "intensify")) {
 		return intensify(argc, argv);
+	} else if (!strcmp(argv[1], "pipe")) {
+		return pipe(argc, argv);
 	} else if (!strcmp(argv[1], "poissonify")) {
 		return poissonify(argc, argv);
 	} else if (!strcmp(argv[1], "rebin")) {
 		return rebin(argc, argv);
 	} else if (!strcmp(argv[1], "rebin_rl")) {
 		return rebin_rl(argc, argv);
+	} else if (!strcmp(argv[1], "rebin_rl_batch")) {
+		return rebin_rl_batch(argc, argv);
 	} else if (!strcmp(argv[1], "rotate")) {
 		return rotate(argc, argv);
 	} else if (!strcmp(argv[1], "show")) {
 		return show(argc, argv);
 	} else if (!strcmp(argv[1], "scale")) {
 		return scale(argc, argv);
+	} else if (!strcmp(argv[1], "serve")) {
+		return serve(argc, argv);
 	} else if (!strcmp(argv[1], "split")) {
 		return split(argc, argv);
+	} else if (!strcmp(argv[1], "stats")) {
+		return stats(argc, argv);
+	} else if (!strcmp(argv[1], "sweep")) {
+		return sweep(argc, argv);
 	} else if (!strcmp(argv[1], "translate")) {
 		return translate(argc, argv);
+	} else if (!strcmp(argv[1], "warp")) {
+		return warp(argc, argv);
 	} else {
 		printf("Command %s not implemented.\n", argv[1]);
+		return 1;
 	}
 
 	return 0;
+}
+
+
+int main(int argc, char* argv[]) {
+	return run(argc, argv);
 }
\ No newline at end of file
@@ -1,20 +1,251 @@
 #include "CImg.h"
+#include <fftw3.h>
+#include "tinytiffwriter.h"
+#include <random>
+#include <string>
+#include <vector>
 using namespace cimg_library;
 
 namespace fish {
-	CImg<> affine(const CImg<> &raw, const float affmat[16]);
+	// In-place complex FFT of a fixed shape. The buffer and plans are kept for the
+	// lifetime of the object so repeated transforms do not allocate or re-plan.
+	// Transforms are unnormalised, as in FFTW.
+	class FFT {
+	public:
+		FFT(const int width, const int height, const int depth, const int num_threads);
+		~FFT();
+		void forward();
+		void backward();
+		CImgList<> get_data() const;
+		void set_data(const CImg<> &real);
+
+		const int width, height, depth, size;
+		fftw_complex* data;
+
+	private:
+		FFT(const FFT&);
+		FFT& operator=(const FFT&);
+		fftw_plan plan_forward, plan_backward;
+	};
+
+	// Real-to-complex FFT of a fixed shape, holding (width / 2 + 1) x height x depth
+	// frequencies. Transforms are unnormalised and the backward transform overwrites
+	// the spectrum.
+	class RealFFT {
+	public:
+		RealFFT(const int width, const int height, const int depth, const int num_threads);
+		~RealFFT();
+		void forward();
+		void backward();
+
+		const int width, height, depth, size, spectrum_size;
+		double* real;
+		fftw_complex* spectrum;
+
+	private:
+		RealFFT(const RealFFT&);
+		RealFFT& operator=(const RealFFT&);
+		fftw_plan plan_forward, plan_backward;
+	};
+
+	// Buffers reused across rebin_rl iterations
+	struct RLWorkspace {
+		RLWorkspace(const int width, const int height, const int scale, const int num_threads);
+		CImg<> estimate;
+		FFT binned, unbinned;
+	};
+
+	// Lazily evaluated chain of operations. Each call adds a node and returns its id; nothing is computed
+	// until evaluate(), after optimize() has folded compatible steps (thinning and affine products, rebin
+	// chains) and fused consecutive pointwise stages into single passes.
+	struct GraphNode {
+		std::string op, method;
+		int input, consumers;
+		int width, height, depth;
+		bool integral;
+		std::vector<float> params;
+		std::vector<std::pair<char, float> > stages;
+		CImg<> result;
+	};
+
+	class Graph {
+	public:
+		int input(const CImg<> &img);
+		bool set_input(const int node, const CImg<> &img);
+		int dim(const int node, const float scale);
+		int poissonify(const int node, const float scale);
+		int affine(const int node, const float affmat[16], const int width, const int height, const int depth, const char* method);
+		int rotate(const int node, const float angle, const char* method);
+		int translate(const int node, const float shift_x, const float shift_y, const char* method);
+		int scale(const int node, const float pin, const float pout);
+		int rebin(const int node, const int scale, const char* method);
+		int rebin(const int node, const float scale_x, const float scale_y, const float scale_z);
+		void optimize();
+		CImg<> evaluate(const int node);
+		std::string describe(const int node) const;
+
+		std::vector<GraphNode> nodes;
+
+	private:
+		int add(const GraphNode &node);
+		bool fold(const int n);
+		void relink(const int n, const int input);
+		void release(const int n);
+		CImg<> run(const int n, const unsigned int seed);
+	};
+
+	// Metrics between results and the ground truth, accumulated as the results are produced, e.g. page by page
+	class MetricAccumulator {
+	public:
+		MetricAccumulator(const std::vector<std::string> &methods);
+		void add(const CImg<> &est, const CImg<> &truth);
+		double value(const int m) const;
+		void report() const;
+
+		const std::vector<std::string> methods;
+
+	private:
+		std::vector<double> sums;
+		long num_pixels;
+		int num_planes;
+		float truth_min, truth_max;
+	};
+
+	// Photon-count diagnostics (range, moments, integrality and a histogram of integer values), accumulated
+	// frame by frame, e.g. to decide whether fast paths for counts or narrow output types apply
+	class ImageStats {
+	public:
+		ImageStats();
+		void add(const CImg<> &img);
+		bool integral() const;
+		double mean() const;
+		double variance() const;
+		double dispersion() const;
+		const char* dtype() const;
+		void report_json(std::FILE* out) const;
+
+		static const int histogram_bins = 65536;
+		long num_pixels, num_non_integer, num_negative, num_zero, num_above;
+		float min, max;
+		std::vector<long> histogram;
+
+	private:
+		double sum, sum_squares;
+	};
+
+	// Output pixels hit by the sub-samples of one input pixel (by offset, or -1 when outside), for
+	// splitting its photons between them
+	struct SampleTargets {
+		SampleTargets(const int num_samples);
+		void clear();
+		void add(const long target);
+		void deposit(CImg<> &out, const float value, std::default_random_engine &generator) const;
+		std::vector<long> targets;
+		std::vector<int> hits;
+		int num_targets, num_samples;
+	};
+
+	CImg<> affine(const CImg<> &raw, const float affmat[16], const char* method);
+	CImg<> affine(const CImg<> &raw, const float affmat[16], const int width, const int height, const int depth, const char* method);
+	CImg<> affine_area(const CImg<> &raw, const float affmat[16], const int width, const int height, const int depth);
+	CImg<> affine_coord(const CImg<> &raw, const float affmat[16], const int width, const int height, const int depth);
+	bool affine_chain(const char* chain, int &width, int &height, int &depth, float affmat[16]);
+	void affine_compose(const float second[16], const float first[16], float affmat[16]);
+	void affine_identity(float affmat[16]);
+	void affine_rotation(const float angle, const float centre_x, const float centre_y, float affmat[16]);
+	void affine_scaling(const float scale_x, const float scale_y, const float scale_z, float affmat[16]);
+	void affine_translation(const float shift_x, const float shift_y, const float shift_z, float affmat[16]);
 	CImg<> dim(const CImg<> &raw, const float scale);
-	CImg<> error_map(const CImg<> &est, const CImg<> truth, const char* method);
+	CImgList<> dim_series(const CImg<> &raw, const std::vector<float> &levels);
+	CImg<> error_map(const CImg<> &est, const CImg<> &truth, const char* method);
+	CImg<> error_map(const CImg<> &est, const CImg<> &truth, const char* method, const int window);
+	CImg<> error_map_local(const CImg<> &est, const CImg<> &truth, const char* method, const int window);
+	CImgList<double> error_sums(const CImg<> &est, const CImg<> &truth);
+	std::vector<double> frc(const CImg<> &a, const CImg<> &b, std::vector<double> &counts);
+	double frc_resolution(const std::vector<double> &curve, const std::vector<double> &counts, const char* threshold);
+	double frc_threshold(const double count, const char* threshold);
 	CImg<> intensify(const CImg<> &raw, const float scale);
 	CImg<> poissonify(const CImg<> &raw, const float scale);
 	CImg<> rebin(const CImg<> &raw, const int scale, const char* method);
+	CImg<> rebin(const CImg<> &raw, const float scale_x, const float scale_y, const float scale_z);
+	CImg<> rebin_exact(const CImg<> &raw, const float factor_x, const float factor_y, const float factor_z);
 	CImg<> rebin_rl(const CImg<> &raw, const int scale, const CImg<> &psf, const int num_iters);
+	CImg<> rebin_rl(const CImg<> &raw, const int scale, const CImgList<> &otf, const int num_iters, RLWorkspace &ws);
+	CImgList<> rebin_rl_otf(const CImg<> &psf, const int width, const int height, const int scale, const char* cache_dir);
+	void rebin_rl_batch(const std::vector<std::string> &files_in, const std::vector<std::string> &files_out,
+						const int scale, const CImg<> &psf, const int num_iters, const char* cache_dir);
 	CImg<> rotate(const CImg<> &raw, const float angle, const char* method);
+	CImg<> rotate3d(const CImg<> &raw, const float angle, const float axis[3], const float centre[3], const char* method);
+	void rotate_sweep(const CImg<> &raw, const float start, const float stop, const float step, const char* method,
+					  const char* file_out);
+	void rotate3d(const char* file_in, const char* file_out, const float angle, const float axis[3], const float centre[3],
+				  const char* method, const int slab);
 	CImg<> scale(const CImg<> &raw, const float pin, const float pout);
+	void serve(const char* socket_path, int (*handler)(int, char**));
 	CImgList<> split(const CImg<> &raw, const float p1);
 	CImg<> translate(const CImg<> &raw, const float x_shift, const float y_shift, const char* method);
+	bool load_trajectory(const char* filename, const int num_frames, std::vector<float> &shift_x,
+						 std::vector<float> &shift_y, std::vector<float> &angle);
+	void translate_trajectory(const char* file_in, const char* file_out, const std::vector<float> &shift_x,
+							  const std::vector<float> &shift_y, const std::vector<float> &angle, const char* method);
+
+	CImg<> warp(const CImg<> &raw, const CImg<> &field, const char* method);
+	CImg<> warp_area(const CImg<> &raw, const CImg<> &field);
+	CImg<> warp_coord(const CImg<> &raw, const CImg<> &field);
+
 	CImg<> load_tiff(const char* filename);
-	double error(const CImg<> &est, const CImg<> truth, const char* method);
+	ImageStats image_stats(const char* filename);
+	void set_image_cache(const size_t max_bytes);
+	CImg<> load_tiff(const char* filename, const int first_frame, const int last_frame);
+	int tiff_num_frames(const char* filename);
+	int redirect_stdout(const int fd);
+	void restore_stdout(const int saved);
+	TinyTIFFFile* open_tiff(const char* filename, int width, int height);
+	void save_tiff_frames(TinyTIFFFile* tiff, CImg<> &img, float pitch_xy, float spacing_z);
+	void close_tiff(TinyTIFFFile* tiff);
+	double error(const CImg<> &est, const CImg<> &truth, const char* method);
+	double error_value(const CImg<> &est, const CImg<> &truth, const char* method);
+	const char* error_description(const char* method);
+	void error_frames(const char* file_est, const char* file_truth, const std::vector<std::string> &methods, const char* file_out);
+	std::vector<double> error_bootstrap(const CImg<> &est, const CImg<> &truth, const char* method, const int num_replicates,
+										const int block);
+	void bootstrap_interval(std::vector<double> values, const double level, double &lower, double &upper);
+	void bootstrap_report(const char* method, const std::vector<double> &values);
+	double error_mse(const CImg<> &est, const CImg<> &truth);
+	double error_rmse(const CImg<> &est, const CImg<> &truth);
+	double error_psnr(const CImg<> &est, const CImg<> &truth);
+	double error_deviance(const CImg<> &est, const CImg<> &truth);
+	double error_log_likelihood(const CImg<> &est, const CImg<> &truth);
+	CImg<> deviance_map(const CImg<> &est, const CImg<> &truth);
+	CImg<> log_likelihood_map(const CImg<> &est, const CImg<> &truth);
+	double error_ssim(const CImg<> &est, const CImg<> &truth);
+	double error_ms_ssim(const CImg<> &est, const CImg<> &truth);
+	CImg<> ssim_map(const CImg<> &est, const CImg<> &truth);
+	void gaussian_filter_xy(CImgList<> &planes);
 	void save_tiff(CImg<> &img, const char* filename, float pitch_xy, float spacing_z);
+	bool save_tiff(CImg<> &img, const char* filename);
 	bool check_bounds(const CImg<> &img, int x, int y);
+	void check_same_size(const CImg<> &est, const CImg<> &truth);
+	double pairwise_sum(const double* values, const long num_values);
+
+	// Sum of term(i) over [0, size), in parallel but independent of the number of threads: fixed blocks
+	// are summed in order and the block sums combined pairwise
+	template <typename Term> double block_sum(const long size, const Term &term) {
+		const long block = 4096, num_blocks = (size + block - 1) / block;
+		std::vector<double> sums(num_blocks);
+		#pragma omp parallel for
+		for (long b = 0; b < num_blocks; b++) {
+			const long end = std::min(size, (b + 1) * block);
+			double sum = 0;
+			#pragma omp simd reduction(+:sum)
+			for (long i = b * block; i < end; i++) sum += term(i);
+			sums[b] = sum;
+		}
+		return pairwise_sum(sums.data(), num_blocks);
+	}
+
+	RealFFT& real_fft(const int width, const int height, const int depth, const int num_threads);
+	void set_random_seed(const unsigned int seed);
+	unsigned int random_seed();
+	std::default_random_engine random_generator(const unsigned int seed, const unsigned int stream);
 }
@@ -0,0 +1,97 @@
+#include "CImg.h"
+#include "fish.h"
+#include <cmath>
+#include <omp.h>
+#include <vector>
+
+using namespace cimg_library;
+
+
+namespace fish{
+	std::vector<double> frc(const CImg<> &a, const CImg<> &b, std::vector<double> &counts) {
+		// Fourier ring correlation of two images, or shell correlation of two volumes. Ring r holds the
+		// frequencies whose radius rounds to r / n cycles per pixel, for n the smallest dimension, up to the
+		// Nyquist ring n / 2. counts receives the number of coefficients in each ring.
+		check_same_size(a, b);
+		const int width = a.width(), height = a.height(), depth = a.depth();
+		const int n = depth > 1 ? std::min(width, std::min(height, depth)) : std::min(width, height);
+		const int num_rings = n / 2 + 1;
+
+		// The transforms use every thread unless frc is itself called from a parallel region
+		RealFFT &fft = real_fft(width, height, depth, omp_in_parallel() ? 1 : omp_get_max_threads());
+		std::copy(a.data(), a.data() + a.size(), fft.real);
+		fft.forward();
+		std::vector<double> spectrum_a((const double*) fft.spectrum, (const double*) (fft.spectrum + fft.spectrum_size));
+		std::copy(b.data(), b.data() + b.size(), fft.real);
+		fft.forward();
+		const fftw_complex *const spectrum_b = fft.spectrum;
+
+		// Per-thread sums, combined in thread order
+		const int half_width = width / 2 + 1;
+		std::vector<double> sums(4 * num_rings, 0.0);
+		#pragma omp parallel
+		{
+			std::vector<double> local(4 * num_rings, 0.0);
+			#pragma omp for schedule(static) nowait
+			for (int row = 0; row < height * depth; row++) {
+				const int ky = row % height, kz = row / height;
+				const double fy = (double) (ky <= height / 2 ? ky : ky - height) * n / height;
+				const double fz = (double) (kz <= depth / 2 ? kz : kz - depth) * n / depth;
+				for (int kx = 0; kx < half_width; kx++) {
+					const double fx = (double) kx * n / width;
+					const int r = (int) (std::sqrt(fx * fx + fy * fy + fz * fz) + 0.5);
+					if (r >= num_rings) continue;
+					const double *const va = &spectrum_a[2 * ((size_t) row * half_width + kx)];
+					const double *const vb = spectrum_b[(size_t) row * half_width + kx];
+					// Coefficients other than x = 0 and Nyquist also stand for their conjugates
+					const double w = (kx == 0 || 2 * kx == width) ? 1 : 2;
+					local[4 * r] += w * (va[0] * vb[0] + va[1] * vb[1]);
+					local[4 * r + 1] += w * (va[0] * va[0] + va[1] * va[1]);
+					local[4 * r + 2] += w * (vb[0] * vb[0] + vb[1] * vb[1]);
+					local[4 * r + 3] += w;
+				}
+			}
+			#pragma omp for ordered schedule(static, 1)
+			for (int t = 0; t < omp_get_num_threads(); t++) {
+				#pragma omp ordered
+				for (size_t i = 0; i < sums.size(); i++) sums[i] += local[i];
+			}
+		}
+
+		std::vector<double> curve(num_rings);
+		counts.assign(num_rings, 0);
+		for (int r = 0; r < num_rings; r++) {
+			const double norm = std::sqrt(sums[4 * r + 1] * sums[4 * r + 2]);
+			curve[r] = norm > 0 ? sums[4 * r] / norm : 0;
+			counts[r] = sums[4 * r + 3];
+		}
+		return curve;
+	}
+
+
+	double frc_threshold(const double count, const char* threshold) {
+		if (!strcmp(threshold, "half_bit")) {
+			// van Heel & Schatz (2005)
+			const double root = std::sqrt(std::max(count, 1.0));
+			return (0.2071 + 1.9102 / root) / (1.2071 + 0.9102 / root);
+		} else if (!strcmp(threshold, "1/7")) {
+			return 1.0 / 7;
+		}
+		printf("\n%s threshold not implemented.\n", threshold);
+		exit(1);
+	}
+
+
+	double frc_resolution(const std::vector<double> &curve, const std::vector<double> &counts, const char* threshold) {
+		// Ring (fractional, interpolated linearly) at which the curve first falls below the threshold, or 0 if
+		// it never does
+		for (size_t r = 1; r < curve.size(); r++) {
+			const double below = curve[r] - frc_threshold(counts[r], threshold);
+			if (below < 0) {
+				const double above = curve[r - 1] - frc_threshold(counts[r - 1], threshold);
+				return r - 1 + (above > 0 ? above / (above - below) : 0);
+			}
+		}
+		return 0;
+	}
+}
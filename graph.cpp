@@ -0,0 +1,428 @@
+#include "CImg.h"
+#include "fish.h"
+#include <random>
+#include <cmath>
+
+using namespace cimg_library;
+
+
+namespace fish{
+	static bool is_integer(const float v) {
+		return v == floor(v);
+	}
+
+
+	static bool is_integral(const CImg<> &img) {
+		// Photon counts only: non-negative integers
+		const float *const data = img.data();
+		const long size = img.size();
+		long num_other = 0;
+		#pragma omp parallel for simd reduction(+:num_other)
+		for (long i = 0; i < size; i++) {
+			num_other += data[i] < 0 || data[i] != floorf(data[i]);
+		}
+		return !num_other;
+	}
+
+
+	static bool is_move(const GraphNode &node) {
+		// Operations moving whole photons independently of each other, which thinning commutes with
+		return node.op == "affine" || node.op == "rebin_exact";
+	}
+
+
+	CImg<> pointwise(const CImg<> &raw, const std::vector<std::pair<char, float> > &stages) {
+		CImg<> out(raw.width(), raw.height(), raw.depth(), 1, 0);
+		const unsigned int seed = fish::random_seed();
+
+		int start_time = cimg::time();
+		printf("\nApplying %d pointwise stage%s in one pass...", (int) stages.size(), stages.size() == 1 ? "" : "s");
+		fflush(stdout);
+
+		#pragma omp parallel for
+		for (int row = 0; row < raw.height() * raw.depth(); row++) {
+			const int y = row % raw.height(), z = row / raw.height();
+			std::default_random_engine generator = fish::random_generator(seed, row);
+			for (int x = 0; x < raw.width(); x++) {
+				float v = raw(x, y, z);
+				for (size_t s = 0; s < stages.size(); s++) {
+					if (stages[s].first == 'd') {
+						std::binomial_distribution<> ddist((int) v, stages[s].second);
+						v = ddist(generator);
+					} else {
+						std::poisson_distribution<> pdist(round(v * stages[s].second));
+						v = pdist(generator);
+					}
+				}
+				out(x, y, z) = v;
+			}
+		}
+
+		int pointwise_time = cimg::time() - start_time;
+		printf(" (completed in %d ms)\n", pointwise_time);
+
+		return out;
+	}
+
+
+	int Graph::add(const GraphNode &node) {
+		if (node.input >= 0) nodes[node.input].consumers++;
+		nodes.push_back(node);
+		return nodes.size() - 1;
+	}
+
+
+	int Graph::input(const CImg<> &img) {
+		GraphNode node;
+		node.op = "input";
+		node.input = -1;
+		node.consumers = 0;
+		node.width = img.width();
+		node.height = img.height();
+		node.depth = img.depth();
+		node.integral = is_integral(img);
+		node.result = img;
+		return add(node);
+	}
+
+
+	bool Graph::set_input(const int n, const CImg<> &img) {
+		// Replace the image of input node n, e.g. with the next page of a stack, keeping the optimised chain.
+		// Folds may rely on the shape and on the input being photon counts, so the new image must match those.
+		GraphNode &node = nodes[n];
+		if (node.op != "input" || node.width != img.width() || node.height != img.height() || node.depth != img.depth() ||
+			(node.integral && !is_integral(img))) return false;
+		node.result = img;
+		return true;
+	}
+
+
+	int Graph::dim(const int n, const float scale) {
+		if (scale > 1.0) {
+			printf("\nScale > 1.0 not supported. Please use intensify instead.\n");
+			exit(1);
+		}
+		if (scale < 0) {
+			printf("\nScale must be in [0, 1].\n");
+			exit(1);
+		}
+		GraphNode node = nodes[n];
+		node.op = "dim";
+		node.input = n;
+		node.consumers = 0;
+		node.integral = true;
+		node.params.assign(1, scale);
+		node.result.assign();
+		return add(node);
+	}
+
+
+	int Graph::poissonify(const int n, const float scale) {
+		GraphNode node = nodes[n];
+		node.op = "poissonify";
+		node.input = n;
+		node.consumers = 0;
+		node.integral = true;
+		node.params.assign(1, scale);
+		node.result.assign();
+		return add(node);
+	}
+
+
+	int Graph::affine(const int n, const float affmat[16], const int width, const int height, const int depth, const char* method) {
+		if (strcmp(method, "coord") && strcmp(method, "area")) {
+			printf("\n%s method not implemented.\n", method);
+			exit(1);
+		}
+		GraphNode node = nodes[n];
+		node.op = "affine";
+		node.method = method;
+		node.input = n;
+		node.consumers = 0;
+		node.width = width;
+		node.height = height;
+		node.depth = depth;
+		node.params.assign(affmat, affmat + 16);
+		node.result.assign();
+		return add(node);
+	}
+
+
+	int Graph::rotate(const int n, const float angle, const char* method) {
+		// Coordinate rotations are affines, so they can fold with neighbouring transforms
+		if (strcmp(method, "nn")) {
+			float affmat[16];
+			fish::affine_rotation(angle, nodes[n].width / 2.0f, nodes[n].height / 2.0f, affmat);
+			return affine(n, affmat, nodes[n].width, nodes[n].height, nodes[n].depth, "coord");
+		}
+		GraphNode node = nodes[n];
+		node.op = "rotate";
+		node.method = method;
+		node.input = n;
+		node.consumers = 0;
+		node.params.assign(1, angle);
+		node.result.assign();
+		return add(node);
+	}
+
+
+	int Graph::translate(const int n, const float shift_x, const float shift_y, const char* method) {
+		if (!strcmp(method, "coord") || !strcmp(method, "area")) {
+			float affmat[16];
+			fish::affine_translation(shift_x, shift_y, 0, affmat);
+			return affine(n, affmat, nodes[n].width, nodes[n].height, nodes[n].depth, method);
+		}
+		GraphNode node = nodes[n];
+		node.op = "translate";
+		node.method = method;
+		node.input = n;
+		node.consumers = 0;
+		node.params.assign(2, shift_x);
+		node.params[1] = shift_y;
+		node.result.assign();
+		return add(node);
+	}
+
+
+	int Graph::scale(const int n, const float pin, const float pout) {
+		return rebin(n, pout / pin, pout / pin, 1);
+	}
+
+
+	int Graph::rebin(const int n, const float scale_x, const float scale_y, const float scale_z) {
+		if (!(std::isfinite(scale_x) && std::isfinite(scale_y) && std::isfinite(scale_z) &&
+			  scale_x > 0 && scale_y > 0 && scale_z > 0)) {
+			printf("\nRebinning factors must be finite and positive (got %g x %g x %g).\n", scale_x, scale_y, scale_z);
+			exit(1);
+		}
+		GraphNode node = nodes[n];
+		node.op = "rebin_exact";
+		node.input = n;
+		node.consumers = 0;
+		node.width = std::max(1, (int) ceil(node.width / scale_x - 1e-3));
+		node.height = std::max(1, (int) ceil(node.height / scale_y - 1e-3));
+		node.depth = std::max(1, (int) ceil(node.depth / scale_z - 1e-3));
+		node.params.assign(3, scale_x);
+		node.params[1] = scale_y;
+		node.params[2] = scale_z;
+		node.result.assign();
+		return add(node);
+	}
+
+
+	int Graph::rebin(const int n, const int scale, const char* method) {
+		if (scale < 1) {
+			printf("\nRebinning scale must be at least 1 (got %d).\n", scale);
+			exit(1);
+		}
+		if (!strcmp(method, "down")) return rebin(n, (float) scale, (float) scale, 1.0f);
+		GraphNode node = nodes[n];
+		node.op = "rebin";
+		node.method = method;
+		node.input = n;
+		node.consumers = 0;
+		node.width *= scale;
+		node.height *= scale;
+		node.integral = false;
+		node.params.assign(1, scale);
+		node.result.assign();
+		return add(node);
+	}
+
+
+	void Graph::relink(const int n, const int input) {
+		nodes[input].consumers++;
+		const int previous = nodes[n].input;
+		nodes[n].input = input;
+		release(previous);
+	}
+
+
+	void Graph::release(const int n) {
+		// Nodes left without consumers by folding are marked -1; they can still be evaluated on their own
+		if (--nodes[n].consumers == 0) {
+			nodes[n].consumers = -1;
+			if (nodes[n].input >= 0) release(nodes[n].input);
+		}
+	}
+
+
+	bool Graph::fold(const int n) {
+		// Merge node n with its input where the result is distributed the same. Chained transforms differ
+		// only by skipping the intermediate quantisation to pixels, and by keeping photons that leave the
+		// intermediate frame but land inside the final one.
+		const int i = nodes[n].input;
+		if (i < 0 || nodes[n].consumers < 0 || nodes[i].consumers != 1 || !nodes[i].result.is_empty()) return false;
+		GraphNode &node = nodes[n];
+		const GraphNode &in = nodes[i];
+
+		if (node.op == "dim" && in.op == "dim") {
+			node.params[0] *= in.params[0];
+			relink(n, in.input);
+			return true;
+		}
+
+		if (node.op == "dim" && is_move(in) && nodes[in.input].integral) {
+			// Thin before moving, so fewer photons are moved
+			GraphNode thinned = nodes[in.input];
+			thinned.op = "dim";
+			thinned.input = in.input;
+			thinned.consumers = 0;
+			thinned.params = node.params;
+			thinned.stages.clear();
+			thinned.result.assign();
+			const int t = add(thinned);
+			GraphNode moved = nodes[i];
+			moved.input = i;
+			moved.consumers = nodes[n].consumers;
+			nodes[n] = moved;
+			relink(n, t);
+			return true;
+		}
+
+		if (node.op == "affine" && in.op == "affine" && node.method == in.method) {
+			float affmat[16];
+			fish::affine_compose(&node.params[0], &in.params[0], affmat);
+			node.params.assign(affmat, affmat + 16);
+			relink(n, in.input);
+			return true;
+		}
+
+		if (node.op == "rebin_exact" && in.op == "rebin_exact") {
+			// Rebinning twice equals rebinning once when the first bins are whole and the second ones
+			// whole numbers of them
+			const int size[3] = {nodes[in.input].width, nodes[in.input].height, nodes[in.input].depth};
+			bool exact = true;
+			for (int a = 0; a < 3; a++) {
+				const float first = in.params[a], second = node.params[a];
+				exact = exact && (first == 1 || second == 1 ||
+								  (is_integer(first) && is_integer(second) && size[a] % (int) first == 0));
+			}
+			if (exact) {
+				for (int a = 0; a < 3; a++) node.params[a] *= in.params[a];
+				relink(n, in.input);
+				return true;
+			}
+		}
+
+		if (node.op == "rebin_exact" && in.op == "affine" && in.method == "coord") {
+			// A coord transform places photons by rounding down, so binning its output by whole
+			// factors is the same as scaling its matrix
+			const int size[3] = {in.width, in.height, in.depth};
+			bool exact = true;
+			for (int a = 0; a < 3; a++) {
+				exact = exact && is_integer(node.params[a]) && size[a] % (int) node.params[a] == 0;
+			}
+			if (exact) {
+				float scaling[16], affmat[16];
+				fish::affine_scaling(1 / node.params[0], 1 / node.params[1], 1 / node.params[2], scaling);
+				fish::affine_compose(scaling, &in.params[0], affmat);
+				node.op = "affine";
+				node.method = "coord";
+				node.params.assign(affmat, affmat + 16);
+				relink(n, in.input);
+				return true;
+			}
+		}
+
+		if (node.op == "pointwise" && in.op == "pointwise") {
+			node.stages.insert(node.stages.begin(), in.stages.begin(), in.stages.end());
+			relink(n, in.input);
+			return true;
+		}
+
+		return false;
+	}
+
+
+	void Graph::optimize() {
+		bool changed = true;
+		while (changed) {
+			changed = false;
+			for (int n = 0; n < (int) nodes.size(); n++) changed = fold(n) || changed;
+		}
+
+		// Fuse runs of per-pixel stages into single passes
+		for (int n = 0; n < (int) nodes.size(); n++) {
+			if (nodes[n].op == "dim" || nodes[n].op == "poissonify") {
+				nodes[n].stages.assign(1, std::make_pair(nodes[n].op[0], nodes[n].params[0]));
+				nodes[n].op = "pointwise";
+			}
+		}
+		changed = true;
+		while (changed) {
+			changed = false;
+			for (int n = 0; n < (int) nodes.size(); n++) changed = fold(n) || changed;
+		}
+	}
+
+
+	CImg<> Graph::run(const int n, const unsigned int seed) {
+		const GraphNode &node = nodes[n];
+		if (!node.result.is_empty()) return node.result;
+		const CImg<> raw = run(node.input, seed);
+
+		// Every node draws from its own streams
+		fish::set_random_seed(seed + 0x9e3779b9u * n);
+		CImg<> out;
+		if (node.op == "dim" || node.op == "poissonify") {
+			out = fish::pointwise(raw, std::vector<std::pair<char, float> >(1, std::make_pair(node.op[0], node.params[0])));
+		} else if (node.op == "pointwise") {
+			out = fish::pointwise(raw, node.stages);
+		} else if (node.op == "affine") {
+			out = fish::affine(raw, &node.params[0], node.width, node.height, node.depth, node.method.c_str());
+		} else if (node.op == "rebin_exact") {
+			out = fish::rebin(raw, node.params[0], node.params[1], node.params[2]);
+		} else if (node.op == "rebin") {
+			out = fish::rebin(raw, (int) node.params[0], node.method.c_str());
+		} else {
+			// The nn rotation and the binomial and Fourier translations work on one plane, so volumes are
+			// moved slice by slice, each slice drawing from its own streams
+			const unsigned int node_seed = fish::random_seed();
+			out.assign(raw.width(), raw.height(), raw.depth(), 1);
+			for (int z = 0; z < raw.depth(); z++) {
+				fish::set_random_seed(node_seed + z);
+				const CImg<> slice = raw.get_slice(z);
+				if (node.op == "rotate") out.draw_image(0, 0, z, fish::rotate(slice, node.params[0], node.method.c_str()));
+				else out.draw_image(0, 0, z, fish::translate(slice, node.params[0], node.params[1], node.method.c_str()));
+			}
+		}
+		fish::set_random_seed(seed);
+
+		// Keep results used more than once, e.g. a prefix shared by several outputs
+		if (nodes[n].consumers > 1) nodes[n].result = out;
+		return out;
+	}
+
+
+	CImg<> Graph::evaluate(const int n) {
+		return run(n, fish::random_seed());
+	}
+
+
+	std::string Graph::describe(const int n) const {
+		const GraphNode &node = nodes[n];
+		char step[256];
+		if (node.op == "input") {
+			snprintf(step, sizeof(step), "input %dx%dx%d", node.width, node.height, node.depth);
+			return step;
+		}
+		if (node.op == "pointwise") {
+			std::string stages;
+			for (size_t s = 0; s < node.stages.size(); s++) {
+				snprintf(step, sizeof(step), "%s%s %g", s ? ", " : "", node.stages[s].first == 'd' ? "dim" : "poissonify",
+						 node.stages[s].second);
+				stages += step;
+			}
+			return describe(node.input) + " -> pointwise(" + stages + ")";
+		}
+		if (node.op == "rebin_exact") {
+			snprintf(step, sizeof(step), "rebin %g x %g x %g", node.params[0], node.params[1], node.params[2]);
+		} else if (node.method.empty()) {
+			snprintf(step, sizeof(step), "%s %g", node.op.c_str(), node.params[0]);
+		} else {
+			snprintf(step, sizeof(step), "%s %s", node.op.c_str(), node.method.c_str());
+		}
+		return describe(node.input) + " -> " + step;
+	}
+}
@@ -0,0 +1,66 @@
+#include "fish.h"
+#include <functional>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Shared by fish_test and fish_bench: the photon kernels both exercise, and quietening the progress the
+// kernels report on stdout
+
+struct Kernel {
+	const char* name;
+	std::function<CImg<>(const CImg<> &)> run;
+	bool volume, conserves, stochastic;  // Needs a volume, keeps the photon count, depends on the seed
+};
+
+
+inline std::vector<Kernel> photon_kernels() {
+	// Kernels taking and giving photon counts, on images whose photons lie a few pixels inside the edges
+	std::vector<Kernel> list;
+	list.push_back(Kernel{"translate_coord", [](const CImg<> &img) { return fish::translate(img, 2.5, -1.25, "coord"); }, false, true, true});
+	list.push_back(Kernel{"translate_binomial", [](const CImg<> &img) { return fish::translate(img, 2.5, -1.25, "binomial"); }, false, true, true});
+	list.push_back(Kernel{"translate_area", [](const CImg<> &img) { return fish::translate(img, 2.5, -1.25, "area"); }, false, true, true});
+	list.push_back(Kernel{"translate_fourier", [](const CImg<> &img) { return fish::translate(img, 2.5, -1.25, "fourier"); }, false, false, true});
+	list.push_back(Kernel{"rotate_coord", [](const CImg<> &img) { return fish::rotate(img, 30, "coord"); }, false, true, true});
+	list.push_back(Kernel{"rotate_nn", [](const CImg<> &img) { return fish::rotate(img, 30, "nn"); }, false, false, false});
+	for (const char* method : {"coord", "area"}) {
+		list.push_back(Kernel{method == std::string("coord") ? "affine_coord" : "affine_area", [method](const CImg<> &img) {
+			float affmat[16];
+			fish::affine_rotation(30, img.width() / 2.0f, img.height() / 2.0f, affmat);
+			return fish::affine(img, affmat, method);
+		}, false, true, true});
+	}
+	for (const char* method : {"coord", "area"}) {
+		// A smooth swirl of up to two pixels; building it is a small part of the call
+		list.push_back(Kernel{method == std::string("coord") ? "warp_coord" : "warp_area", [method](const CImg<> &img) {
+			CImg<> field(img.width(), img.height(), 1, 2);
+			cimg_forXY(field, x, y) {
+				field(x, y, 0, 0) = 2 * sin(y * 0.05);
+				field(x, y, 0, 1) = 2 * cos(x * 0.05);
+			}
+			return fish::warp(img, field, method);
+		}, false, true, true});
+	}
+	list.push_back(Kernel{"rebin_down", [](const CImg<> &img) { return fish::rebin(img, 2, "down"); }, false, true, false});
+	list.push_back(Kernel{"rebin_exact", [](const CImg<> &img) { return fish::rebin(img, 1.5f, 0.75f, 1.0f); }, false, true, true});
+	list.push_back(Kernel{"rebin_up_thin_nn", [](const CImg<> &img) { return fish::rebin(img, 2, "up_thin_nn"); }, false, true, true});
+	list.push_back(Kernel{"split", [](const CImg<> &img) { return fish::split(img, 0.3).get_append('x'); }, false, true, true});
+	list.push_back(Kernel{"dim", [](const CImg<> &img) { return fish::dim(img, 0.5); }, false, false, true});
+	list.push_back(Kernel{"poissonify", [](const CImg<> &img) { return fish::poissonify(img, 1.0); }, false, false, true});
+	list.push_back(Kernel{"intensify", [](const CImg<> &img) { return fish::intensify(img, 2.0); }, false, false, true});
+	return list;
+}
+
+
+inline int mute_stdout() {
+	// Until fish::restore_stdout is given the returned descriptor
+#ifndef _WIN32
+	const int null = open("/dev/null", O_WRONLY);
+	const int saved = fish::redirect_stdout(null);
+	close(null);
+	return saved;
+#else
+	return -1;
+#endif
+}
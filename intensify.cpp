@@ -1,4 +1,5 @@
 #include "CImg.h"
+#include "fish.h"
 #include <random>
 #include <cmath>
 
@@ -12,14 +13,14 @@ int C(int n, int k) {
 }
 
 double binomial(int N, int x, float p) {
-	C(N, x) * pow(p, x) * pow(1 - p, N - x);
+	return C(N, x) * pow(p, x) * pow(1 - p, N - x);
 }
 
 
 namespace fish{
 	CImg<> intensify_binom(const CImg<> &raw, const float scale) {
 		CImg<> intensified(raw.width(), raw.height(), 1, 1, 0);
-		std::default_random_engine generator;
+		std::default_random_engine generator = fish::random_generator(fish::random_seed(), 0);
 
 		if (scale < 1.0) {
 			printf("\nScale < 1.0 not supported. Please use dim instead.\n");
@@ -1,11 +1,138 @@
 #include "CImg.h"
 #include "tinytiffwriter.h"
+#include <tiffio.h>
+#include <climits>
+#include <map>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 using namespace cimg_library;
 
 namespace fish {
+    struct CachedImage {
+        CImg<> img;
+        long long mtime, mtime_nsec, size;
+        unsigned long last_use;
+    };
+
+    static std::map<std::string, CachedImage> image_cache;
+    static size_t image_cache_limit = 0, image_cache_bytes = 0;
+    static unsigned long image_cache_clock = 0;
+    static std::mutex image_cache_mutex;
+
+    void set_image_cache(const size_t max_bytes) {
+        // Keep images loaded with load_tiff, up to max_bytes, and reuse them while the file is unchanged
+        std::lock_guard<std::mutex> lock(image_cache_mutex);
+        image_cache_limit = max_bytes;
+        if (!max_bytes) {
+            image_cache.clear();
+            image_cache_bytes = 0;
+        }
+    }
+
+    static bool is_shm(const char* filename) {
+        return !strncmp(filename, "shm:", 4);
+    }
+
+#ifndef _WIN32
+    // Images can be passed through POSIX shared memory as shm:/name. The object holds four 32-bit ints
+    // (width, height, depth, spectrum) followed by the float data.
+    static int open_shm(const char* name, int dims[4], size_t &bytes) {
+        // Descriptor of the object, after checking that its header describes an image it can hold
+        const int fd = shm_open(name, O_RDONLY, 0);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) || st.st_size < 16 || pread(fd, dims, 16, 0) != 16) {
+            printf("\nCould not open shared memory %s.\n", name);
+            exit(1);
+        }
+        const size_t size = (size_t) dims[0] * dims[1] * dims[2] * dims[3];
+        if (dims[0] <= 0 || dims[1] <= 0 || dims[2] <= 0 || dims[3] <= 0 || 16 + size * sizeof(float) > (size_t) st.st_size) {
+            printf("\nShared memory %s does not hold a valid image.\n", name);
+            exit(1);
+        }
+        bytes = st.st_size;
+        return fd;
+    }
+
+    static CImg<> load_shm(const char* name, const int first_frame, const int last_frame) {
+        // Slices first_frame to last_frame (clamped to the image), copying only those from the mapping
+        int dims[4];
+        size_t bytes;
+        const int fd = open_shm(name, dims, bytes);
+        void* buffer = mmap(0, bytes, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (buffer == MAP_FAILED) {
+            printf("\nCould not map shared memory %s.\n", name);
+            exit(1);
+        }
+        const int first = std::max(0, std::min(first_frame, dims[2] - 1));
+        const int last = std::max(first, std::min(last_frame, dims[2] - 1));
+        const size_t slice = (size_t) dims[0] * dims[1];
+        const float* data = (const float*) ((const char*) buffer + 16);
+        CImg<> img(dims[0], dims[1], last - first + 1, dims[3]);
+        for (int c = 0; c < dims[3]; c++) {
+            std::memcpy(img.data(0, 0, 0, c), data + ((size_t) c * dims[2] + first) * slice, img.depth() * slice * sizeof(float));
+        }
+        munmap(buffer, bytes);
+        return img;
+    }
+
+    static int shm_num_frames(const char* name) {
+        int dims[4];
+        size_t bytes;
+        close(open_shm(name, dims, bytes));
+        return dims[2];
+    }
+
+    static void save_shm(const CImg<> &img, const char* name) {
+        const size_t bytes = 16 + img.size() * sizeof(float);
+        const int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+        if (fd < 0 || ftruncate(fd, bytes)) {
+            printf("\nCould not create shared memory %s.\n", name);
+            exit(1);
+        }
+        void* buffer = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (buffer == MAP_FAILED) {
+            printf("\nCould not map shared memory %s.\n", name);
+            exit(1);
+        }
+        int* dims = (int*) buffer;
+        dims[0] = img.width();
+        dims[1] = img.height();
+        dims[2] = img.depth();
+        dims[3] = img.spectrum();
+        std::memcpy((char*) buffer + 16, img.data(), img.size() * sizeof(float));
+        munmap(buffer, bytes);
+    }
+#else
+    static CImg<> load_shm(const char* name, const int first_frame, const int last_frame) {
+        printf("\nShared memory images are not supported on this platform.\n");
+        exit(1);
+    }
+
+    static int shm_num_frames(const char* name) {
+        load_shm(name, 0, 0);
+        return 0;
+    }
+
+    static void save_shm(const CImg<> &img, const char* name) {
+        load_shm(name, 0, 0);
+    }
+#endif
+
     void save_tiff(CImg<> &img, const char* filename, float pitch_xy, float spacing_z) {
         int start_time = cimg::time();
+        if (is_shm(filename)) {
+            save_shm(img, filename + 4);
+            return;
+        }
         TinyTIFFFile* tiff = TinyTIFFWriter_open(filename, 32, img.width(), img.height());
         if (tiff) {
             for (int slice = 0; slice < img.depth(); slice++) {
@@ -19,13 +146,141 @@ namespace fish {
         printf("\n");
     }
 
+    bool save_tiff(CImg<> &img, const char* filename) {
+        // Without reporting, as from several threads at once; false if the file could not be opened
+        if (is_shm(filename)) {
+            save_shm(img, filename + 4);
+            return true;
+        }
+        TinyTIFFFile* tiff = TinyTIFFWriter_open(filename, 32, img.width(), img.height());
+        if (!tiff) return false;
+        for (int slice = 0; slice < img.depth(); slice++) {
+            TinyTIFFWriter_writeImageIJ(tiff, img.data(0, 0, slice), 0, 0);
+        }
+        TinyTIFFWriter_close(tiff);
+        return true;
+    }
+
+    static long long mtime_nsec(const struct stat &st) {
+        // Sub-second part of the modification time, so a file rewritten within a second is still seen
+#ifndef _WIN32
+        return st.st_mtim.tv_nsec;
+#else
+        return 0;
+#endif
+    }
+
+    static CImg<> load_cached(const char* filename) {
+        struct stat st;
+        if (stat(filename, &st)) return CImg<>(filename);
+        {
+            std::lock_guard<std::mutex> lock(image_cache_mutex);
+            std::map<std::string, CachedImage>::iterator cached = image_cache.find(filename);
+            if (cached != image_cache.end()) {
+                if (cached->second.mtime == (long long) st.st_mtime && cached->second.mtime_nsec == (long long) mtime_nsec(st) &&
+                    cached->second.size == (long long) st.st_size) {
+                    cached->second.last_use = ++image_cache_clock;
+                    return cached->second.img;
+                }
+                image_cache_bytes -= cached->second.img.size() * sizeof(float);
+                image_cache.erase(cached);
+            }
+        }
+
+        CImg<> img(filename);
+        const size_t bytes = img.size() * sizeof(float);
+        std::lock_guard<std::mutex> lock(image_cache_mutex);
+        if (bytes > image_cache_limit || image_cache.count(filename)) return img;
+        while (image_cache_bytes + bytes > image_cache_limit) {
+            // Evict the least recently used
+            std::map<std::string, CachedImage>::iterator oldest = image_cache.begin();
+            for (std::map<std::string, CachedImage>::iterator it = image_cache.begin(); it != image_cache.end(); ++it) {
+                if (it->second.last_use < oldest->second.last_use) oldest = it;
+            }
+            image_cache_bytes -= oldest->second.img.size() * sizeof(float);
+            image_cache.erase(oldest);
+        }
+        CachedImage &entry = image_cache[filename];
+        entry.img = img;
+        entry.mtime = st.st_mtime;
+        entry.mtime_nsec = mtime_nsec(st);
+        entry.size = st.st_size;
+        entry.last_use = ++image_cache_clock;
+        image_cache_bytes += bytes;
+        return img;
+    }
+
     CImg<> load_tiff(const char* filename) {
         int start_time = cimg::time();
-        CImg<> img(filename);
+        CImg<> img = is_shm(filename) ? load_shm(filename + 4, 0, INT_MAX) : image_cache_limit ? load_cached(filename) : CImg<>(filename);
         int in_time = cimg::time() - start_time;
         printf("\nLoad time:     %d ms\n", in_time);
         printf("Dimensions:    %d x %d x %d\n", img.width(), img.height(), img.depth());
 
         return img;
     }
-}
\ No newline at end of file
+
+    CImg<> load_tiff(const char* filename, const int first_frame, const int last_frame) {
+        // Frames first_frame to last_frame (inclusive, or to the end if negative) as the slices of one image,
+        // without reporting
+        if (is_shm(filename)) return load_shm(filename + 4, first_frame, last_frame < 0 ? INT_MAX : last_frame);
+        CImg<> img;
+        img.load_tiff(filename, first_frame, last_frame);
+        return img;
+    }
+
+    int tiff_num_frames(const char* filename) {
+        if (is_shm(filename)) return shm_num_frames(filename + 4);
+        TIFF* tif = TIFFOpen(filename, "r");
+        if (!tif) {
+            printf("\nCould not open %s.\n", filename);
+            exit(1);
+        }
+        int num_frames = TIFFNumberOfDirectories(tif);
+        TIFFClose(tif);
+        return num_frames;
+    }
+
+    int redirect_stdout(const int fd) {
+        // Send stdout to fd, e.g. stderr to keep progress apart from a table on stdout, until restore_stdout
+        // is given the returned descriptor
+        std::fflush(stdout);
+#ifndef _WIN32
+        const int saved = dup(1);
+        dup2(fd, 1);
+        return saved;
+#else
+        return -1;
+#endif
+    }
+
+    void restore_stdout(const int saved) {
+        if (saved < 0) return;
+        std::fflush(stdout);
+#ifndef _WIN32
+        dup2(saved, 1);
+        close(saved);
+#endif
+    }
+
+    TinyTIFFFile* open_tiff(const char* filename, int width, int height) {
+        // For writing an image frame by frame with save_tiff_frames
+        TinyTIFFFile* tiff = TinyTIFFWriter_open(filename, 32, width, height);
+        if (!tiff) {
+            printf("\nCould not open %s for writing.\n", filename);
+            exit(1);
+        }
+        return tiff;
+    }
+
+    void save_tiff_frames(TinyTIFFFile* tiff, CImg<> &img, float pitch_xy, float spacing_z) {
+        for (int slice = 0; slice < img.depth(); slice++) {
+            float* data = img.data(0, 0, slice);
+            TinyTIFFWriter_writeImageIJ(tiff, data, pitch_xy, spacing_z);
+        }
+    }
+
+    void close_tiff(TinyTIFFFile* tiff) {
+        TinyTIFFWriter_close(tiff);
+    }
+}
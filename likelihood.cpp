@@ -0,0 +1,87 @@
+#include "CImg.h"
+#include "fish.h"
+#include <cmath>
+#include <vector>
+
+using namespace cimg_library;
+
+
+namespace fish{
+	// Poisson figures of merit for an estimate of counts y given the true mean mu. Means are floored at
+	// poisson_floor, so a count where the truth is zero costs a large finite amount rather than infinity.
+
+	const float poisson_floor = 1e-6f;
+	const int log_factorial_size = 4096;
+
+
+	static const std::vector<double>& log_factorials() {
+		// log(k!) for small counts, built once
+		static const std::vector<double> table = [] {
+			std::vector<double> t(log_factorial_size);
+			t[0] = 0;
+			for (int k = 1; k < log_factorial_size; k++) t[k] = t[k - 1] + std::log((double) k);
+			return t;
+		}();
+		return table;
+	}
+
+
+	static inline double log_factorial(const double *table, const float y) {
+		return (y >= 0 && y < log_factorial_size && y == (int) y) ? table[(int) y] : std::lgamma(y + 1.0);
+	}
+
+
+	static inline double poisson_deviance(const float y, const float mean) {
+		// 2 (y log(y / mu) - (y - mu)), which tends to 2 mu as y goes to 0
+		const double mu = std::max(mean, poisson_floor);
+		return y > 0 ? 2 * (y * std::log(y / mu) - (y - mu)) : 2 * mu;
+	}
+
+
+	static inline double poisson_log_likelihood(const double *table, const float y, const float mean) {
+		const double mu = std::max(mean, poisson_floor);
+		return (y > 0 ? y * std::log(mu) : 0) - mu - log_factorial(table, y);
+	}
+
+
+	double error_deviance(const CImg<> &est, const CImg<> &truth) {
+		// Mean per pixel
+		check_same_size(est, truth);
+		const float *const e = est.data(), *const t = truth.data();
+		return block_sum(truth.size(), [=](const long i) { return poisson_deviance(e[i], t[i]); }) / truth.size();
+	}
+
+
+	double error_log_likelihood(const CImg<> &est, const CImg<> &truth) {
+		// Mean per pixel
+		check_same_size(est, truth);
+		const float *const e = est.data(), *const t = truth.data();
+		const double *const table = log_factorials().data();
+		return block_sum(truth.size(), [=](const long i) { return poisson_log_likelihood(table, e[i], t[i]); }) / truth.size();
+	}
+
+
+	CImg<> deviance_map(const CImg<> &est, const CImg<> &truth) {
+		check_same_size(est, truth);
+		CImg<> map(truth.width(), truth.height(), truth.depth(), 1);
+		const long size = truth.size();
+		#pragma omp parallel for simd
+		for (long i = 0; i < size; i++) {
+			map[i] = poisson_deviance(est[i], truth[i]);
+		}
+		return map;
+	}
+
+
+	CImg<> log_likelihood_map(const CImg<> &est, const CImg<> &truth) {
+		check_same_size(est, truth);
+		CImg<> map(truth.width(), truth.height(), truth.depth(), 1);
+		const double *const table = log_factorials().data();
+		const long size = truth.size();
+		#pragma omp parallel for simd
+		for (long i = 0; i < size; i++) {
+			map[i] = poisson_log_likelihood(table, est[i], truth[i]);
+		}
+		return map;
+	}
+}
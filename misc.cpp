@@ -1,9 +1,49 @@
 #include "CImg.h"
+#include <random>
 
 using namespace cimg_library;
 
 namespace fish {
+	static thread_local unsigned int base_seed = std::default_random_engine::default_seed;
+
 	bool check_bounds(const CImg<> &img, int x, int y) {
 		return (x >= 0 && x < img.width() && y >= 0 && y < img.height()) ? true : false;
 	}
-}
\ No newline at end of file
+
+
+	void check_same_size(const CImg<> &est, const CImg<> &truth) {
+		if (!est.is_sameXYZC(truth)) {
+			printf("\nImage sizes differ (%d x %d x %d and %d x %d x %d).\n", est.width(), est.height(), est.depth(),
+				   truth.width(), truth.height(), truth.depth());
+			exit(1);
+		}
+	}
+
+
+	double pairwise_sum(const double* values, const long num_values) {
+		if (num_values <= 8) {
+			double sum = 0;
+			for (long i = 0; i < num_values; i++) sum += values[i];
+			return sum;
+		}
+		const long half = num_values / 2;
+		return pairwise_sum(values, half) + pairwise_sum(values + half, num_values - half);
+	}
+
+
+	void set_random_seed(const unsigned int seed) {
+		base_seed = seed;
+	}
+
+
+	unsigned int random_seed() {
+		return base_seed;
+	}
+
+
+	std::default_random_engine random_generator(const unsigned int seed, const unsigned int stream) {
+		// Independent, reproducible streams for parallel loops (e.g. one per row)
+		std::seed_seq sequence{seed, stream};
+		return std::default_random_engine(sequence);
+	}
+}
@@ -1,4 +1,5 @@
 #include "CImg.h"
+#include "fish.h"
 #include <random>
 
 using namespace cimg_library;
@@ -7,7 +8,7 @@ using namespace cimg_library;
 namespace fish{
 	CImg<> poissonify(const CImg<> &raw, const float scale) {
 		CImg<> poissonified(raw.width(), raw.height(), 1, 1, 0);
-		std::default_random_engine generator;
+		std::default_random_engine generator = fish::random_generator(fish::random_seed(), 0);
 
 		int start_time = cimg::time();
 		printf("\nPoissonifying image...");
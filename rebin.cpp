@@ -4,6 +4,12 @@
 #include <cassert>
 #include <vector>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <cstdio>
+#include <unistd.h>
 
 using namespace cimg_library;
 
@@ -29,24 +35,117 @@ CImgList<> psf2otf(const CImg<>& psf, const int width, const int height, const i
 	h.draw_image(x0, y0, z0, psf);
 	h = h / (float) sum;
 	h.shift(width / 2, height / 2, depth / 2, 0, 2);
-	return h.get_FFT();
+
+	fish::FFT f(width, height, depth, 0);
+	f.set_data(h);
+	f.forward();
+	return f.get_data();
 }
 
 
 namespace fish{
-	CImg<> rebin_down(const CImg<> &raw, const int scale) {
-		CImg<> scaled(raw.width() / scale, raw.height() / scale, 1, 1, 0);
+	struct Overlaps {
+		// For each input pixel i, the output pixels index[offset[i]] .. index[offset[i + 1] - 1] it overlaps,
+		// the fraction of it falling in each, and the probability of a photon landing in each given that it
+		// did not land in an earlier one
+		int size_out;
+		std::vector<int> offset, index;
+		std::vector<float> weight, conditional;
+	};
+
+
+	Overlaps rebin_overlaps(const int size_in, const float factor) {
+		// Output pixel j covers input coordinates [j * factor, (j + 1) * factor), keeping partial edge pixels
+		Overlaps ov;
+		ov.size_out = std::max(1, (int) ceil(size_in / factor - 1e-3));
+		ov.offset.push_back(0);
+		for (int i = 0; i < size_in; i++) {
+			const int j_first = std::min((int) floor(i / factor), ov.size_out - 1);
+			const int j_last = std::min((int) ceil((i + 1) / factor) - 1, ov.size_out - 1);
+			float remaining = 1;
+			for (int j = j_first; j <= j_last; j++) {
+				const float overlap = (j == j_last) ? remaining :
+					std::min((j + 1) * factor, (float) (i + 1)) - std::max(j * factor, (float) i);
+				if (overlap <= 0) continue;
+				ov.index.push_back(j);
+				ov.weight.push_back(overlap);
+				ov.conditional.push_back(j == j_last ? 1 : overlap / remaining);
+				remaining -= overlap;
+			}
+			ov.offset.push_back(ov.index.size());
+		}
+		return ov;
+	}
 
-		cimg_forXY(raw, x, y) {
-			int xr = x / scale;
-			int yr = y / scale;
-			scaled(xr, yr) += raw(x, y);
+
+	CImg<> rebin_axis(const CImg<> &raw, const Overlaps &ov, const char axis, const unsigned int seed) {
+		// Lines along the axis are n pixels apart by 'inner', and there are 'outer' independent blocks of them,
+		// counting every channel
+		const int n = (axis == 'x') ? raw.width() : (axis == 'y') ? raw.height() : raw.depth();
+		const int inner = (axis == 'x') ? 1 : (axis == 'y') ? raw.width() : raw.width() * raw.height();
+		const int outer = raw.size() / (n * inner);
+		const int block = 64;
+		const int num_blocks = (inner + block - 1) / block;
+		CImg<> scaled(axis == 'x' ? ov.size_out : raw.width(), axis == 'y' ? ov.size_out : raw.height(),
+					  axis == 'z' ? ov.size_out : raw.depth(), raw.spectrum(), 0);
+
+		#pragma omp parallel for schedule(dynamic)
+		for (int task = 0; task < outer * num_blocks; task++) {
+			const int o = task / num_blocks, k0 = (task % num_blocks) * block, k1 = std::min(k0 + block, inner);
+			std::default_random_engine generator = fish::random_generator(seed, axis * 1000003 + task);
+			const float *const in = raw.data() + (size_t) o * n * inner;
+			float *const out = scaled.data() + (size_t) o * ov.size_out * inner;
+			for (int i = 0; i < n; i++) {
+				const int first = ov.offset[i], last = ov.offset[i + 1] - 1;
+				for (int k = k0; k < k1; k++) {
+					const float v = in[(size_t) i * inner + k];
+					if (first == last) {
+						out[(size_t) ov.index[first] * inner + k] += v;
+					} else if (v >= 0 && v == floor(v)) {
+						// Photon counts are split exactly, as a multinomial over the overlapped pixels
+						int photon_num = v;
+						for (int m = first; m <= last && photon_num > 0; m++) {
+							std::binomial_distribution<> bdist(photon_num, ov.conditional[m]);
+							const int landed = (m == last) ? photon_num : bdist(generator);
+							out[(size_t) ov.index[m] * inner + k] += landed;
+							photon_num -= landed;
+						}
+					} else {
+						for (int m = first; m <= last; m++) {
+							out[(size_t) ov.index[m] * inner + k] += v * ov.weight[m];
+						}
+					}
+				}
+			}
 		}
 
 		return scaled;
 	}
 
 
+	CImg<> rebin_exact(const CImg<> &raw, const float factor_x, const float factor_y, const float factor_z) {
+		// Rebin to pixels factor_x x factor_y x factor_z times the size of the input ones, in separable passes.
+		// Each photon lands uniformly within its pixel, so x, y and z bins are independent and the result is
+		// distributed exactly as if every photon had been drawn individually.
+		if (!(std::isfinite(factor_x) && std::isfinite(factor_y) && std::isfinite(factor_z) &&
+			  factor_x > 0 && factor_y > 0 && factor_z > 0)) {
+			printf("\nRebinning factors must be finite and positive (got %g x %g x %g).\n", factor_x, factor_y, factor_z);
+			exit(1);
+		}
+		const unsigned int seed = fish::random_seed();
+		CImg<> scaled(raw, false);
+		if (factor_x != 1) scaled = rebin_axis(scaled, rebin_overlaps(scaled.width(), factor_x), 'x', seed);
+		if (factor_y != 1) scaled = rebin_axis(scaled, rebin_overlaps(scaled.height(), factor_y), 'y', seed);
+		if (factor_z != 1) scaled = rebin_axis(scaled, rebin_overlaps(scaled.depth(), factor_z), 'z', seed);
+		return scaled;
+	}
+
+
+	CImg<> rebin_down(const CImg<> &raw, const int scale) {
+		return rebin_exact(raw, scale, scale, 1);
+	}
+
+
 	CImg<> rebin_up_nn(const CImg<> &raw, const int scale) {
 		CImg<> scaled(raw.width() * scale, raw.height() * scale, 1, 1, 0);
 
@@ -111,7 +210,7 @@ namespace fish{
 		}
 
 		CImg<> diff(scaled.width(), scaled.height(), 1, 1, 0);
-		std::default_random_engine generator;
+		std::default_random_engine generator = fish::random_generator(fish::random_seed(), 0);
 		cimg_forXY(diff, x, y) {
 			std::poisson_distribution<int> pdist(scaled(x, y));
 			diff(x, y) = pdist(generator) - scaled(x, y);
@@ -135,7 +234,7 @@ namespace fish{
 	CImg<> rebin_up_weighted(const CImg<> &raw, const CImg<> &weights, const int scale) {
 		CImg<> scaled(raw.width() * scale, raw.height() * scale, 1, 1, 0);
 
-		std::default_random_engine generator;
+		std::default_random_engine generator = fish::random_generator(fish::random_seed(), 0);
 
 		cimg_forXY(raw, x, y) {
 			int num_photons = raw(x, y);
@@ -189,78 +288,298 @@ namespace fish{
 	}
 
 
-	CImg<> rebin_rl(const CImg<> &raw, const int scale, const CImg<> &psf, const int num_iters) {
+	RLWorkspace::RLWorkspace(const int width, const int height, const int scale, const int num_threads) :
+		estimate(width * scale, height * scale, 1, 1, 0),
+		binned(width, height, 1, num_threads),
+		unbinned(width * scale, height * scale, 1, num_threads) {
+	}
+
+
+	unsigned long long psf_hash(const CImg<> &psf) {
+		// FNV-1a over the dimensions and raw bytes of the PSF
+		unsigned long long hash = 14695981039346656037ULL;
+		const int dims[3] = {psf.width(), psf.height(), psf.depth()};
+		const unsigned char *bytes = (const unsigned char*) dims;
+		for (size_t i = 0; i < sizeof(dims); i++) hash = (hash ^ bytes[i]) * 1099511628211ULL;
+		bytes = (const unsigned char*) psf.data();
+		for (size_t i = 0; i < psf.size() * sizeof(float); i++) hash = (hash ^ bytes[i]) * 1099511628211ULL;
+		return hash;
+	}
+
+
+	CImgList<> rebin_rl_otf(const CImg<> &psf, const int width, const int height, const int scale, const char* cache_dir) {
+		// Returns the real and imaginary parts of H followed by those of H_unbinned. The OTFs are computed
+		// at the image size and absorb the 1/N normalisation of the inverse transforms.
+		const int width_s = width * scale, height_s = height * scale;
+		char filename[1024];
+		if (cache_dir) {
+			snprintf(filename, sizeof(filename), "%s/otf_%016llx_%dx%d_s%d.cimg", cache_dir, psf_hash(psf), width, height, scale);
+			if (cimg::is_file(filename)) {
+				CImgList<> otf = CImgList<>::get_load_cimg(filename);
+				if (otf.size() == 4 && otf[0].is_sameXY(width, height) && otf[2].is_sameXY(width_s, height_s)) {
+					return otf;
+				}
+			}
+		}
+
+		CImgList<> H = psf2otf(psf, width, height, 1);
+		CImgList<> H_unbinned = psf2otf(fish::rebin_up_nn(psf, scale), width_s, height_s, 1);
+		cimglist_for(H, l) H[l] /= (float) (width * height);
+		cimglist_for(H_unbinned, l) H_unbinned[l] /= (float) (width_s * height_s);
+		CImgList<> otf(H[0], H[1], H_unbinned[0], H_unbinned[1]);
+
+		if (cache_dir) {
+			// Write under a temporary name so concurrent runs never read a partial file
+			char temp_filename[1100];
+			snprintf(temp_filename, sizeof(temp_filename), "%s.%d.tmp", filename, (int) getpid());
+			try {
+				otf.save_cimg(temp_filename);
+				std::rename(temp_filename, filename);
+			} catch (CImgException &) {
+				// An unwritable cache only costs the recomputation next time
+				std::remove(temp_filename);
+			}
+		}
+
+		return otf;
+	}
+
+
+	CImg<> rebin_rl(const CImg<> &raw, const int scale, const CImgList<> &otf, const int num_iters, RLWorkspace &ws) {
 		// Use a blurred RL deconvolution of the image to provide the weights for photon reassignment
 		
-		CImg<> scaled(raw.width() * scale, raw.height() * scale, 1, 1, 0);
-
 		const float eps = 1e-2;
+		const int width = raw.width(), height = raw.height();
+		const int width_s = width * scale;
+		const CImg<> &H_re = otf[0], &H_im = otf[1], &H_unbinned_re = otf[2], &H_unbinned_im = otf[3];
+		const float unbin_norm = 1.0f / (scale * scale);
 
-		CImgList<> H = psf2otf(psf, psf.width(), psf.height(), psf.depth());
-		CImgList<> H_unbinned = psf2otf(fish::rebin_up_nn(psf, scale), scale * psf.width(), scale * psf.height(), scale * psf.depth());
+		CImg<> &estimate = ws.estimate;
+		fftw_complex *const binned = ws.binned.data, *const unbinned = ws.unbinned.data;
 
 		// CImg<> estimate = fish::rebin_up_nn(raw, scale).get_max(eps).blur(4.0f);
-		CImg<> estimate(scaled.width(), scaled.height(), 1, 1, raw.mean());
-		CImg<> estimate_binned;
-		CImgList<> temp(2, scaled.width(), scaled.height(), scaled.depth(), 1, 0);
-		CImgList<> temp_binned(2, raw.width(), raw.height(), raw.depth(), 1, 0);
-
-		
+		estimate.fill(raw.mean());
+
+		for (int i = 0; i <= num_iters; i++) {
+			// Apply the previous update via multiplication, then bin down
+			#pragma omp parallel for
+			for (int yr = 0; yr < height; yr++) {
+				for (int xr = 0; xr < width; xr++) {
+					binned[yr * width + xr][0] = 0;
+					binned[yr * width + xr][1] = 0;
+				}
+				for (int y = yr * scale; y < (yr + 1) * scale; y++) {
+					float *const est_row = estimate.data(0, y);
+					const fftw_complex *const update_row = unbinned + (size_t) y * width_s;
+					if (i > 0) {
+						for (int x = 0; x < width_s; x++) {
+							est_row[x] *= update_row[x][0];
+						}
+					}
+					if (i < num_iters) {
+						for (int x = 0; x < width_s; x++) {
+							binned[yr * width + x / scale][0] += est_row[x];
+						}
+					}
+				}
+			}
+			if (i == num_iters) break;
 
-		for (int i = 0; i < num_iters; i++) {
-			// Bin down
-			estimate_binned = fish::rebin_down(estimate, scale);
-			
 			// Convolve with PSF (Fourier-wise with H)
-			temp_binned = estimate_binned.get_FFT();
-			cimg_foroff(H[0], i) {
-				const float a = temp_binned[0](i), b = temp_binned[1](i), c = H[0](i), d = H[1](i);
-				temp_binned[0](i) = a*c - b*d;
-				temp_binned[1](i) = a*d + b*c;
+			ws.binned.forward();
+			#pragma omp parallel for
+			for (int j = 0; j < ws.binned.size; j++) {
+				const float a = binned[j][0], b = binned[j][1], c = H_re(j), d = H_im(j);
+				binned[j][0] = a*c - b*d;
+				binned[j][1] = a*d + b*c;
 			}
-			temp_binned.FFT(true);
+			ws.binned.backward();
 			
-			// Compute ratio
-			cimg_foroff(temp_binned[0], i) {
-				if (temp_binned[0](i) > 0)
-					temp_binned[0](i) = std::max(eps, raw(i)) / temp_binned[0](i);
-				temp_binned[1](i) = 0;
+			// Compute ratio and unbin
+			#pragma omp parallel for
+			for (int yr = 0; yr < height; yr++) {
+				fftw_complex *const ratio_row = binned + (size_t) yr * width;
+				for (int xr = 0; xr < width; xr++) {
+					if (ratio_row[xr][0] > 0)
+						ratio_row[xr][0] = std::max(eps, raw(xr, yr)) / ratio_row[xr][0];
+					ratio_row[xr][0] *= unbin_norm;
+				}
+				for (int y = yr * scale; y < (yr + 1) * scale; y++) {
+					fftw_complex *const unbinned_row = unbinned + (size_t) y * width_s;
+					for (int x = 0; x < width_s; x++) {
+						unbinned_row[x][0] = ratio_row[x / scale][0];
+						unbinned_row[x][1] = 0;
+					}
+				}
 			}
 			
-			// Unbin
-			temp[0] = fish::rebin_up_nn(temp_binned[0], scale);
-			temp[1] = fish::rebin_up_nn(temp_binned[1], scale);
-			
 			// Convolve with transpose of PSF (Fourier-wise with H_unbinned)
 			// (at the moment there is no transpose, just conjugation, as we 'know' that the PSF is real)
-			temp.FFT();
-			cimg_foroff(temp[0], i) {
-				const float a = temp[0](i), b = temp[1](i), c = H_unbinned[0](i), d = -H_unbinned[1](i);
-				temp[0](i) = a*c - b*d;
-				temp[1](i) = a*d + b*c;
+			ws.unbinned.forward();
+			#pragma omp parallel for
+			for (int j = 0; j < ws.unbinned.size; j++) {
+				const float a = unbinned[j][0], b = unbinned[j][1], c = H_unbinned_re(j), d = -H_unbinned_im(j);
+				unbinned[j][0] = a*c - b*d;
+				unbinned[j][1] = a*d + b*c;
 			}
-			temp.FFT(true);
-			
-			// Update estimate via multiplication
-			estimate.mul(temp[0]);
+			ws.unbinned.backward();
 		}
 
 		// Reblur
-		temp = estimate.get_FFT();
-		cimg_foroff(temp[0], i) {
-			const float a = temp[0](i), b = temp[1](i), c = H_unbinned[0](i), d = H_unbinned[1](i);
-			temp[0](i) = a*c - b*d;
-			temp[1](i) = a*d + b*c;
+		ws.unbinned.set_data(estimate);
+		ws.unbinned.forward();
+		#pragma omp parallel for
+		for (int j = 0; j < ws.unbinned.size; j++) {
+			const float a = unbinned[j][0], b = unbinned[j][1], c = H_unbinned_re(j), d = H_unbinned_im(j);
+			unbinned[j][0] = a*c - b*d;
+			unbinned[j][1] = a*d + b*c;
+		}
+		ws.unbinned.backward();
+		cimg_foroff(estimate, j) {
+			estimate(j) = unbinned[j][0];
 		}
-		temp.FFT(true);
-		estimate = temp[0];
 
 		return fish::rebin_up_weighted(raw, estimate, scale);
 	}
 
 
+	CImg<> rebin_rl(const CImg<> &raw, const int scale, const CImg<> &psf, const int num_iters) {
+		// OTFs and the workspace are kept for later calls with the same PSF and shape, as when serving
+		// many requests from one process
+		// The least recently used of at most eight OTFs is dropped; each is computed once, outside the lock,
+		// by the first caller to need it
+		struct CachedOTF {
+			std::once_flag once;
+			CImgList<> otf;
+			unsigned long last_use;
+		};
+		static std::map<std::string, std::shared_ptr<CachedOTF> > otfs;
+		static unsigned long clock = 0;
+		static thread_local std::unique_ptr<RLWorkspace> ws;
+		char key[128];
+		snprintf(key, sizeof(key), "%016llx_%dx%d_s%d", psf_hash(psf), raw.width(), raw.height(), scale);
+		std::shared_ptr<CachedOTF> cached;
+		#pragma omp critical(rebin_rl_otfs)
+		{
+			std::shared_ptr<CachedOTF> &entry = otfs[key];
+			if (!entry) {
+				if (otfs.size() > 8) {
+					std::map<std::string, std::shared_ptr<CachedOTF> >::iterator oldest = otfs.end();
+					for (std::map<std::string, std::shared_ptr<CachedOTF> >::iterator it = otfs.begin(); it != otfs.end(); ++it) {
+						if (it->second && (oldest == otfs.end() || it->second->last_use < oldest->second->last_use)) oldest = it;
+					}
+					otfs.erase(oldest);
+				}
+				entry.reset(new CachedOTF());
+			}
+			entry->last_use = ++clock;
+			cached = entry;
+		}
+		std::call_once(cached->once, [&]() {
+			cached->otf = rebin_rl_otf(psf, raw.width(), raw.height(), scale, 0);
+		});
+		const CImgList<> &otf = cached->otf;
+		if (!ws || ws->binned.width != raw.width() || ws->binned.height != raw.height() ||
+			ws->unbinned.width != raw.width() * scale) {
+			ws.reset(new RLWorkspace(raw.width(), raw.height(), scale, 0));
+		}
+		return rebin_rl(raw, scale, otf, num_iters, *ws);
+	}
+
+
+	void rebin_rl_batch(const std::vector<std::string> &files_in, const std::vector<std::string> &files_out,
+						const int scale, const CImg<> &psf, const int num_iters, const char* cache_dir) {
+		// OTFs are shared between all frames of the same shape, each computed once by the first thread to
+		// need it while other shapes go ahead; each thread keeps its own workspace
+		struct SharedOTF {
+			std::once_flag once;
+			CImgList<> otf;
+		};
+		std::map<std::pair<int, int>, std::unique_ptr<SharedOTF> > otfs;
+		if (cache_dir && !cimg::is_directory(cache_dir)) {
+			printf("\nOTF cache directory %s does not exist; OTFs will not be cached.\n", cache_dir);
+			cache_dir = 0;
+		}
+
+		// Files that cannot be read or written are reported and skipped, so one bad file does not end the
+		// batch; an exception escaping the parallel region would terminate the program
+		int num_failed = 0;
+		// Every page of every file draws from its own seed, derived from the caller's rather than from
+		// whichever thread processes it
+		const unsigned int seed = fish::random_seed();
+		const unsigned int num_files = files_in.size();
+
+		#pragma omp parallel
+		{
+			RLWorkspace* ws = 0;
+
+			#pragma omp for schedule(dynamic)
+			for (int i = 0; i < (int) files_in.size(); i++) {
+				CImg<> raw;
+				try {
+					raw = fish::load_tiff(files_in[i].c_str(), 0, -1);
+				} catch (CImgException &e) {
+					raw.assign();
+				}
+				if (raw.is_empty()) {
+					#pragma omp critical(rebin_rl_batch_report)
+					{
+						printf("\nCould not read %s; skipping it.\n", files_in[i].c_str());
+						num_failed++;
+					}
+					continue;
+				}
+				const std::pair<int, int> shape(raw.width(), raw.height());
+
+				SharedOTF *shared;
+				#pragma omp critical(rebin_rl_batch_otfs)
+				{
+					std::unique_ptr<SharedOTF> &entry = otfs[shape];
+					if (!entry) entry.reset(new SharedOTF());
+					shared = entry.get();
+				}
+				std::call_once(shared->once, [&]() {
+					shared->otf = rebin_rl_otf(psf, raw.width(), raw.height(), scale, cache_dir);
+				});
+				const CImgList<> *otf = &shared->otf;
+
+				if (!ws || ws->binned.width != raw.width() || ws->binned.height != raw.height()) {
+					delete ws;
+					ws = new RLWorkspace(raw.width(), raw.height(), scale, 1);
+				}
+
+				const unsigned int thread_seed = fish::random_seed();
+				CImg<> rebinned(raw.width() * scale, raw.height() * scale, raw.depth());
+				for (int z = 0; z < raw.depth(); z++) {
+					fish::set_random_seed(seed + z * num_files + i);
+					rebinned.draw_image(0, 0, z, rebin_rl(raw.get_slice(z), scale, *otf, num_iters, *ws));
+				}
+				fish::set_random_seed(thread_seed);
+				if (!fish::save_tiff(rebinned, files_out[i].c_str())) {
+					#pragma omp critical(rebin_rl_batch_report)
+					{
+						printf("\nCould not write %s.\n", files_out[i].c_str());
+						num_failed++;
+					}
+				}
+			}
+
+			delete ws;
+		}
+
+		if (num_failed) {
+			printf("\n%d of %d images could not be rebinned.\n", num_failed, (int) files_in.size());
+			exit(1);
+		}
+	}
+
+
 	CImg<> rebin(const CImg<> &raw, const int scale, const char* method) {
 		CImg<> rebinned;
+		if (scale < 1) {
+			printf("\nRebinning scale must be at least 1 (got %d).\n", scale);
+			exit(1);
+		}
 
 		int start_time = cimg::time();
 		printf("\nRebinning image");
@@ -294,4 +613,18 @@ namespace fish{
 
 		return rebinned;
 	}
+
+
+	CImg<> rebin(const CImg<> &raw, const float scale_x, const float scale_y, const float scale_z) {
+		CImg<> rebinned;
+
+		int start_time = cimg::time();
+		printf("\nRebinning image by %g x %g x %g using exact method...", scale_x, scale_y, scale_z);
+		fflush(stdout);
+		rebinned = rebin_exact(raw, scale_x, scale_y, scale_z);
+		int rebinning_time = cimg::time() - start_time;
+		printf(" (completed in %d ms)\n", rebinning_time);
+
+		return rebinned;
+	}
 }
@@ -6,9 +6,70 @@
 using namespace cimg_library;
 
 namespace fish{
+	void rotation_matrix(const float angle, const float axis[3], double rot[9]) {
+		// Right-handed rotation by angle (degrees) about axis (Rodrigues' formula); about z this is the
+		// in-plane rotation used by rotate_nn
+		const double norm = std::sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+		const double ux = axis[0] / norm, uy = axis[1] / norm, uz = axis[2] / norm;
+		const double theta = angle * M_PI / 180;
+		const double c = std::cos(theta), s = std::sin(theta), t = 1 - c;
+		rot[0] = c + ux * ux * t;      rot[1] = ux * uy * t - uz * s; rot[2] = ux * uz * t + uy * s;
+		rot[3] = uy * ux * t + uz * s; rot[4] = c + uy * uy * t;      rot[5] = uy * uz * t - ux * s;
+		rot[6] = uz * ux * t - uy * s; rot[7] = uz * uy * t + ux * s; rot[8] = c + uz * uz * t;
+	}
+
+
+	void rotate_nn_row(const CImg<> &raw, const int raw_z0, const double start[3], const double step[3], float* row) {
+		// row[x] = raw at the rounded position start + x * step, for every x where that lies in raw (whose
+		// first slice is slice raw_z0 of the volume). Positions are linear along the row, so the in-bounds
+		// span is found analytically and the gather loop runs without per-pixel tests.
+		const int width = raw.width();
+		const int extent[3] = {raw.width(), raw.height(), raw.depth()};
+		// Position along each axis relative to raw, offset by half a pixel so that truncating a non-negative
+		// value rounds it. The trim and the gather both use this one expression, so they cannot disagree.
+		const double origin[3] = {start[0] + 0.5, start[1] + 0.5, start[2] + 0.5 - raw_z0};
+		auto position = [&](const int a, const int x) { return origin[a] + x * step[a]; };
+		int x0 = 0, x1 = width;
+		for (int a = 0; a < 3; a++) {
+			// The position must stay in [0, extent)
+			const double low = -origin[a], high = extent[a] - origin[a];
+			if (step[a] == 0) {
+				if (low > 0 || high <= 0) return;
+				continue;
+			}
+			const double first = (step[a] > 0 ? low : high) / step[a], last = (step[a] > 0 ? high : low) / step[a];
+			x0 = std::max(x0, (int) std::min(std::max(floor(first), -1.0), width + 1.0));
+			x1 = std::min(x1, (int) std::min(std::max(ceil(last) + 1, -1.0), width + 1.0));
+		}
+
+		// The analytic span may be a pixel too wide; trim it with exact tests at its two ends only. Positions
+		// are monotonic in x, so every pixel between two inside ends is inside too.
+		auto inside = [&](const int x) {
+			for (int a = 0; a < 3; a++) {
+				const double p = position(a, x);
+				if (!(p >= 0) || (int) p >= extent[a]) return false;
+			}
+			return true;
+		};
+		x0 = std::max(x0, 0);
+		while (x0 < x1 && !inside(x0)) x0++;
+		while (x1 > x0 && !inside(x1 - 1)) x1--;
+
+		const float* data = raw.data();
+		const long stride_y = raw.width(), stride_z = (long) raw.width() * raw.height();
+		#pragma omp simd
+		for (int x = x0; x < x1; x++) {
+			const int px = (int) position(0, x);
+			const int py = (int) position(1, x);
+			const int pz = (int) position(2, x);
+			row[x] = data[pz * stride_z + py * stride_y + px];
+		}
+	}
+
+
 	CImg<> rotate_coord(const CImg<> &raw, const float angle) {
 		CImg<> rotated(raw.width(), raw.height(), 1, 1, 0);
-		std::default_random_engine generator;
+		std::default_random_engine generator = fish::random_generator(fish::random_seed(), 0);
 		std::uniform_real_distribution<float> ddist(0.0, 1.0);
 
 		const double theta = -angle * M_PI / 180;
@@ -37,27 +98,183 @@ namespace fish{
 	CImg<> rotate_nn(const CImg<> &raw, const float angle) {
 		CImg<> rotated(raw.width(), raw.height(), 1, 1, 0);
 
-		const double theta = angle * M_PI / 180;
+		const float axis[3] = {0, 0, 1};
+		double rot[9];
+		rotation_matrix(angle, axis, rot);
 		const double centre_x = raw.width() / 2.0;
 		const double centre_y = raw.height() / 2.0;
+		const double step[3] = {rot[0], rot[3], 0};
 
-		cimg_forXY(rotated, x, y) {
-			double xpos = ((double) x - centre_x) + 0.5;
-			double ypos = ((double) y - centre_y) + 0.5;
-			double new_x = std::cos(theta) * xpos - std::sin(theta) * ypos + centre_x - 0.5;
-			double new_y = std::sin(theta) * xpos + std::cos(theta) * ypos + centre_y - 0.5;
-			int px = round(new_x);
-			int py = round(new_y);
-			if (fish::check_bounds(raw, px, py)) {
-				int photon_num = raw(px, py);
-				rotated(x, y) += photon_num;
-			}
+		#pragma omp parallel for
+		for (int y = 0; y < rotated.height(); y++) {
+			const double xpos = 0.5 - centre_x;
+			const double ypos = ((double) y - centre_y) + 0.5;
+			const double start[3] = {rot[0] * xpos + rot[1] * ypos + centre_x - 0.5,
+									 rot[3] * xpos + rot[4] * ypos + centre_y - 0.5, 0};
+			rotate_nn_row(raw, 0, start, step, rotated.data(0, y));
 		}
 		
 		return rotated;
 	}
 
 
+	void rotate3d_source_range(const int width, const int height, const int depth, const int z0, const int z1,
+							   const double rot[9], const float centre[3], int &source_z0, int &source_z1) {
+		// Input slices that can map into output slices z0 .. z1 - 1, from the corners of the slab
+		double z_min = depth, z_max = 0;
+		for (int corner = 0; corner < 8; corner++) {
+			const double px = ((corner & 1) ? width : 0) - centre[0];
+			const double py = ((corner & 2) ? height : 0) - centre[1];
+			const double pz = ((corner & 4) ? z1 : z0) - centre[2];
+			const double source_z = rot[6] * px + rot[7] * py + rot[8] * pz + centre[2];
+			z_min = std::min(z_min, source_z);
+			z_max = std::max(z_max, source_z);
+		}
+		source_z0 = std::max(0, (int) floor(z_min) - 1);
+		source_z1 = std::min(depth, (int) ceil(z_max) + 1);
+	}
+
+
+	void rotate3d_slab(const CImg<> &raw, const int raw_z0, CImg<> &rotated, const int rotated_z0,
+					   const float angle, const float axis[3], const float centre[3], const char* method) {
+		// Rotate the part of a depth-slice volume held in raw (slices raw_z0 onwards) into the output
+		// slices held in rotated (rotated_z0 onwards), which must cover every slice raw can map into
+		const int width = raw.width(), height = raw.height();
+		const int rotated_z1 = rotated_z0 + rotated.depth();
+
+		if (!strcmp(method, "nn")) {
+			// Pull each output voxel centre back into the input
+			double rot[9];
+			rotation_matrix(angle, axis, rot);
+			const double step[3] = {rot[0], rot[3], rot[6]};
+
+			#pragma omp parallel for
+			for (int row = 0; row < rotated.depth() * height; row++) {
+				const int y = row % height, z = rotated_z0 + row / height;
+				const double xpos = 0.5 - centre[0], ypos = y + 0.5 - centre[1], zpos = z + 0.5 - centre[2];
+				const double start[3] = {rot[0] * xpos + rot[1] * ypos + rot[2] * zpos + centre[0] - 0.5,
+										 rot[3] * xpos + rot[4] * ypos + rot[5] * zpos + centre[1] - 0.5,
+										 rot[6] * xpos + rot[7] * ypos + rot[8] * zpos + centre[2] - 0.5};
+				rotate_nn_row(raw, raw_z0, start, step, rotated.data(0, y, z - rotated_z0));
+			}
+		} else {
+			// Push photons forwards, keeping those landing in this slab. Each input row draws from its own
+			// stream so a row processed for several slabs places its photons identically every time.
+			double rot[9];
+			rotation_matrix(-angle, axis, rot);
+			const unsigned int seed = fish::random_seed();
+
+			#pragma omp parallel for schedule(dynamic)
+			for (int row = 0; row < raw.depth() * height; row++) {
+				const int y = row % height, z = raw_z0 + row / height;
+				std::default_random_engine generator = fish::random_generator(seed, z * height + y);
+				std::uniform_real_distribution<float> ddist(0.0, 1.0);
+				for (int x = 0; x < width; x++) {
+					int photon_num = raw(x, y, z - raw_z0);
+					if (photon_num <= 0) continue;
+					for (int i = 0; i < photon_num; i++) {
+						const double xpos = x + ddist(generator) - centre[0];
+						const double ypos = y + ddist(generator) - centre[1];
+						const double zpos = z + ddist(generator) - centre[2];
+						const int px = floor(rot[0] * xpos + rot[1] * ypos + rot[2] * zpos + centre[0]);
+						const int py = floor(rot[3] * xpos + rot[4] * ypos + rot[5] * zpos + centre[1]);
+						const int pz = floor(rot[6] * xpos + rot[7] * ypos + rot[8] * zpos + centre[2]);
+						if (px >= 0 && px < width && py >= 0 && py < height && pz >= rotated_z0 && pz < rotated_z1) {
+							#pragma omp atomic
+							rotated(px, py, pz - rotated_z0) += 1;
+						}
+					}
+				}
+			}
+		}
+	}
+
+
+	CImg<> rotate3d(const CImg<> &raw, const float angle, const float axis[3], const float centre[3], const char* method) {
+		CImg<> rotated(raw.width(), raw.height(), raw.depth(), 1, 0);
+
+		int start_time = cimg::time();
+		printf("\nRotating volume about (%g, %g, %g) using %s method...", axis[0], axis[1], axis[2],
+			   strcmp(method, "nn") ? "coord draw" : "nearest-neighbour");
+		fflush(stdout);
+		rotate3d_slab(raw, 0, rotated, 0, angle, axis, centre, method);
+		int rotation_time = cimg::time() - start_time;
+		printf(" (completed in %d ms)\n", rotation_time);
+
+		return rotated;
+	}
+
+
+	void rotate3d(const char* file_in, const char* file_out, const float angle, const float axis[3], const float centre[3],
+				  const char* method, const int slab) {
+		// Stream the volume through in slabs of output slices, loading only the input slices each one needs.
+		// Memory use depends on how far the rotation tilts slices out of their plane; about z it is two slabs.
+		const int depth = fish::tiff_num_frames(file_in);
+		CImg<> first = fish::load_tiff(file_in, 0, 0);
+		const int width = first.width(), height = first.height();
+		double rot[9];
+		rotation_matrix(angle, axis, rot);
+
+		int start_time = cimg::time();
+		printf("\nRotating %d x %d x %d volume about (%g, %g, %g) in slabs of %d...", width, height, depth,
+			   axis[0], axis[1], axis[2], slab);
+		fflush(stdout);
+		TinyTIFFFile* tiff = fish::open_tiff(file_out, width, height);
+		for (int z0 = 0; z0 < depth; z0 += slab) {
+			const int z1 = std::min(z0 + slab, depth);
+			int source_z0, source_z1;
+			rotate3d_source_range(width, height, depth, z0, z1, rot, centre, source_z0, source_z1);
+			CImg<> rotated(width, height, z1 - z0, 1, 0);
+			if (source_z0 < source_z1) {
+				CImg<> raw = fish::load_tiff(file_in, source_z0, source_z1 - 1);
+				rotate3d_slab(raw, source_z0, rotated, z0, angle, axis, centre, method);
+			}
+			fish::save_tiff_frames(tiff, rotated, 0, 0);
+		}
+		fish::close_tiff(tiff);
+		int rotation_time = cimg::time() - start_time;
+		printf(" (completed in %d ms)\n", rotation_time);
+	}
+
+
+	void rotate_sweep(const CImg<> &raw, const float start, const float stop, const float step, const char* method,
+					  const char* file_out) {
+		// Render rotations by start, start + step, ... (up to but excluding stop) as consecutive pages of one
+		// file. Angles are rendered in parallel, one per thread, and written in order as each completes. Each
+		// angle draws from its own seed, so the pages are independent and do not depend on the thread count.
+		const int num_angles = std::max(0, (int) ceil((stop - start) / step - 1e-4));
+		const float axis[3] = {0, 0, 1};
+		const float centre[3] = {raw.width() / 2.0f, raw.height() / 2.0f, raw.depth() / 2.0f};
+
+		int start_time = cimg::time();
+		printf("\nRendering %d rotations from %g by %g degrees...", num_angles, start, step);
+		fflush(stdout);
+		TinyTIFFFile* tiff = fish::open_tiff(file_out, raw.width(), raw.height());
+		const unsigned int seed = fish::random_seed();
+		#pragma omp parallel for ordered schedule(static, 1)
+		for (int i = 0; i < num_angles; i++) {
+			const float angle = start + i * step;
+			const unsigned int thread_seed = fish::random_seed();
+			fish::set_random_seed(seed + i);
+			CImg<> rotated;
+			if (raw.depth() > 1) {
+				rotated.assign(raw.width(), raw.height(), raw.depth(), 1, 0);
+				rotate3d_slab(raw, 0, rotated, 0, angle, axis, centre, method);
+			} else if (!strcmp(method, "nn")) {
+				rotated = rotate_nn(raw, angle);
+			} else {
+				rotated = rotate_coord(raw, angle);
+			}
+			fish::set_random_seed(thread_seed);
+			#pragma omp ordered
+			fish::save_tiff_frames(tiff, rotated, 0, 0);
+		}
+		fish::close_tiff(tiff);
+		int sweep_time = cimg::time() - start_time;
+		printf(" (completed in %d ms)\n", sweep_time);
+	}
+
+
 	CImg<> rotate(const CImg<> &raw, const float angle, const char* method) {
 		CImg<> rotated;
 
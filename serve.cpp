@@ -0,0 +1,156 @@
+#include "CImg.h"
+#include "fish.h"
+#include <string>
+#include <vector>
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+#endif
+
+using namespace cimg_library;
+
+
+namespace fish{
+#ifndef _WIN32
+	static std::vector<std::string> split_request(const std::string &line) {
+		// Whitespace-separated arguments; double quotes group arguments containing spaces
+		std::vector<std::string> args;
+		std::string arg;
+		bool quoted = false, in_arg = false;
+		for (size_t i = 0; i < line.size(); i++) {
+			const char c = line[i];
+			if (c == '"') {
+				quoted = !quoted;
+				in_arg = true;
+			} else if (!quoted && (c == ' ' || c == '\t' || c == '\r')) {
+				if (in_arg) args.push_back(arg);
+				arg.clear();
+				in_arg = false;
+			} else {
+				arg += c;
+				in_arg = true;
+			}
+		}
+		if (in_arg) args.push_back(arg);
+		return args;
+	}
+
+
+	static void send_reply(const int fd, const char* reply) {
+		for (size_t sent = 0, size = strlen(reply); sent < size; ) {
+			const ssize_t n = write(fd, reply + sent, size - sent);
+			if (n <= 0) return;
+			sent += n;
+		}
+	}
+
+
+	static void serve_connection(const int fd, int (*handler)(int, char**)) {
+		// One request per line, answered with "ok <ms>" or "error <status>"
+		std::string buffer;
+		char chunk[4096];
+		for (;;) {
+			size_t eol;
+			while ((eol = buffer.find('\n')) == std::string::npos) {
+				const ssize_t n = read(fd, chunk, sizeof(chunk));
+				if (n <= 0) return;
+				buffer.append(chunk, n);
+			}
+			std::vector<std::string> args = split_request(buffer.substr(0, eol));
+			buffer.erase(0, eol + 1);
+			if (args.empty()) continue;
+
+			char reply[64];
+			if (args[0] == "ping") {
+				snprintf(reply, sizeof(reply), "ok\n");
+			} else if (args[0] == "quit") {
+				send_reply(fd, "ok\n");
+				close(fd);
+				exit(0);
+			} else if (args[0] == "serve") {
+				snprintf(reply, sizeof(reply), "error 1\n");
+			} else {
+				std::vector<char*> argv(1, (char*) "fish");
+				for (size_t i = 0; i < args.size(); i++) argv.push_back(&args[i][0]);
+				argv.push_back(0);
+
+				// CImg remembers whether help was requested from the first command line it saw
+				cimg::option((char*) 0, 0, 0, (char*) 0, (char*) 0, true);
+				int start_time = cimg::time();
+				const int status = handler(argv.size() - 1, &argv[0]);
+				int request_time = cimg::time() - start_time;
+				fflush(stdout);
+				if (status) snprintf(reply, sizeof(reply), "error %d\n", status);
+				else snprintf(reply, sizeof(reply), "ok %d\n", request_time);
+			}
+			send_reply(fd, reply);
+		}
+	}
+
+
+	void serve(const char* socket_path, int (*handler)(int, char**)) {
+		sockaddr_un address;
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		if (strlen(socket_path) >= sizeof(address.sun_path)) {
+			printf("\nSocket path %s is too long.\n", socket_path);
+			exit(1);
+		}
+		strcpy(address.sun_path, socket_path);
+		const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		unlink(socket_path);
+		// Only the owner may connect: requests read and write files with the server's permissions
+		const mode_t mask = umask(0077);
+		const bool bound = listener >= 0 && !bind(listener, (sockaddr*) &address, sizeof(address));
+		umask(mask);
+		if (!bound || listen(listener, 16)) {
+			printf("\nCould not listen on %s.\n", socket_path);
+			exit(1);
+		}
+		signal(SIGPIPE, SIG_IGN);
+		printf("\nServing on %s\n", socket_path);
+		fflush(stdout);
+
+		// Requests run in a worker process, which keeps loaded images, FFT plans, OTFs and threads between
+		// them. A request that fails fatally ends the worker (its client sees the connection close) and a
+		// fresh one takes over; "quit" stops the server.
+		for (;;) {
+			const pid_t worker = fork();
+			if (worker < 0) {
+				printf("\nCould not start worker.\n");
+				exit(1);
+			}
+			if (worker == 0) {
+#ifdef __linux__
+				prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+				for (;;) {
+					const int fd = accept(listener, 0, 0);
+					if (fd < 0) continue;
+					serve_connection(fd, handler);
+					close(fd);
+				}
+			}
+			int status;
+			waitpid(worker, &status, 0);
+			if (WIFEXITED(status) && WEXITSTATUS(status) == 0) break;
+			printf("\nWorker stopped (status %d), restarting.\n", status);
+			fflush(stdout);
+		}
+		close(listener);
+		unlink(socket_path);
+	}
+#else
+	void serve(const char* socket_path, int (*handler)(int, char**)) {
+		printf("\nServing is not supported on this platform.\n");
+		exit(1);
+	}
+#endif
+}
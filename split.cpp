@@ -0,0 +1,33 @@
+#include "CImg.h"
+#include "fish.h"
+#include <random>
+
+using namespace cimg_library;
+
+
+namespace fish{
+	CImgList<> split(const CImg<> &raw, const float p1) {
+		// Assign each photon to the first image with probability p1 and to the second otherwise, so the two
+		// halves are independent Poisson images if the input is
+		if (p1 < 0 || p1 > 1) {
+			printf("\nProbability must be in [0, 1].\n");
+			exit(1);
+		}
+		CImgList<> halves(2, raw.width(), raw.height(), raw.depth(), 1, 0);
+		const unsigned int seed = fish::random_seed();
+
+		#pragma omp parallel for
+		for (int row = 0; row < raw.height() * raw.depth(); row++) {
+			const int y = row % raw.height(), z = row / raw.height();
+			std::default_random_engine generator = fish::random_generator(seed, row);
+			for (int x = 0; x < raw.width(); x++) {
+				const int photon_num = std::max(0, (int) raw(x, y, z));
+				std::binomial_distribution<> bdist(photon_num, p1);
+				halves[0](x, y, z) = bdist(generator);
+				halves[1](x, y, z) = photon_num - halves[0](x, y, z);
+			}
+		}
+
+		return halves;
+	}
+}
@@ -0,0 +1,157 @@
+#include "CImg.h"
+#include "fish.h"
+#include <cmath>
+#include <vector>
+
+using namespace cimg_library;
+
+
+namespace fish{
+	// SSIM (Wang et al. 2004) with an 11-tap Gaussian window of sigma 1.5, clamped at the edges. Stacks are
+	// compared plane by plane.
+
+	const int ssim_radius = 5;
+	const float ssim_sigma = 1.5f;
+
+
+	void gaussian_filter_xy(CImgList<> &planes) {
+		// Separable filtering of every plane of every image in place, in parallel over rows and then columns
+		float weights[2 * ssim_radius + 1], total = 0;
+		for (int k = -ssim_radius; k <= ssim_radius; k++) {
+			weights[k + ssim_radius] = std::exp(-k * k / (2 * ssim_sigma * ssim_sigma));
+			total += weights[k + ssim_radius];
+		}
+		for (int k = 0; k <= 2 * ssim_radius; k++) weights[k] /= total;
+		const int width = planes[0].width(), height = planes[0].height(), depth = planes[0].depth();
+
+		#pragma omp parallel
+		{
+			std::vector<float> padded(std::max(width, height) + 2 * ssim_radius);
+			#pragma omp for collapse(2)
+			for (int l = 0; l < (int) planes.size(); l++) {
+				for (int row = 0; row < height * depth; row++) {
+					float *const line = planes[l].data(0, row % height, row / height);
+					for (int x = -ssim_radius; x < width + ssim_radius; x++) {
+						padded[x + ssim_radius] = line[std::min(std::max(x, 0), width - 1)];
+					}
+					for (int x = 0; x < width; x++) {
+						float sum = 0;
+						#pragma omp simd reduction(+:sum)
+						for (int k = 0; k <= 2 * ssim_radius; k++) sum += weights[k] * padded[x + k];
+						line[x] = sum;
+					}
+				}
+			}
+
+			// Columns are filtered a whole row at a time, so the inner loop runs along x
+			std::vector<float> rows((size_t) width * height);
+			#pragma omp for collapse(2)
+			for (int l = 0; l < (int) planes.size(); l++) {
+				for (int z = 0; z < depth; z++) {
+					float *const plane = planes[l].data(0, 0, z);
+					std::copy(plane, plane + (size_t) width * height, rows.begin());
+					for (int y = 0; y < height; y++) {
+						float *const out = plane + (size_t) y * width;
+						std::fill(out, out + width, 0.0f);
+						for (int k = -ssim_radius; k <= ssim_radius; k++) {
+							const float *const in = &rows[(size_t) std::min(std::max(y + k, 0), height - 1) * width];
+							const float w = weights[k + ssim_radius];
+							#pragma omp simd
+							for (int x = 0; x < width; x++) out[x] += w * in[x];
+						}
+					}
+				}
+			}
+		}
+	}
+
+
+	static float ssim_range(const CImg<> &truth) {
+		const float range = truth.max() - std::min(0.0f, truth.min());
+		return range > 0 ? range : 1;
+	}
+
+
+	static void ssim_terms(const CImg<> &est, const CImg<> &truth, const float range, CImg<> &luminance, CImg<> &contrast) {
+		// Per-pixel luminance and contrast-structure terms; SSIM is their product
+		const float c1 = (0.01f * range) * (0.01f * range), c2 = (0.03f * range) * (0.03f * range);
+		const long size = truth.size();
+		CImgList<> moments(5, truth.width(), truth.height(), truth.depth(), 1);
+		const float *const e = est.data(), *const t = truth.data();
+		#pragma omp parallel for simd
+		for (long i = 0; i < size; i++) {
+			moments[0][i] = e[i];
+			moments[1][i] = t[i];
+			moments[2][i] = e[i] * e[i];
+			moments[3][i] = t[i] * t[i];
+			moments[4][i] = e[i] * t[i];
+		}
+		gaussian_filter_xy(moments);
+
+		luminance.assign(truth.width(), truth.height(), truth.depth(), 1);
+		contrast.assign(truth.width(), truth.height(), truth.depth(), 1);
+		#pragma omp parallel for simd
+		for (long i = 0; i < size; i++) {
+			const float mu_e = moments[0][i], mu_t = moments[1][i];
+			const float var_e = moments[2][i] - mu_e * mu_e, var_t = moments[3][i] - mu_t * mu_t;
+			const float covar = moments[4][i] - mu_e * mu_t;
+			luminance[i] = (2 * mu_e * mu_t + c1) / (mu_e * mu_e + mu_t * mu_t + c1);
+			contrast[i] = (2 * covar + c2) / (var_e + var_t + c2);
+		}
+	}
+
+
+	CImg<> ssim_map(const CImg<> &est, const CImg<> &truth) {
+		check_same_size(est, truth);
+		CImg<> luminance, contrast;
+		ssim_terms(est, truth, ssim_range(truth), luminance, contrast);
+		return luminance.mul(contrast);
+	}
+
+
+	double error_ssim(const CImg<> &est, const CImg<> &truth) {
+		const CImg<> map = ssim_map(est, truth);
+		const float *const m = map.data();
+		return block_sum(map.size(), [=](const long i) { return (double) m[i]; }) / map.size();
+	}
+
+
+	double error_ms_ssim(const CImg<> &est, const CImg<> &truth) {
+		// Multi-scale SSIM (Wang et al. 2003): contrast-structure at up to five scales, halving the image each
+		// time, and luminance at the coarsest. Scales smaller than the window are skipped and the weights
+		// renormalised; negative terms are clamped to zero so fractional powers stay defined.
+		check_same_size(est, truth);
+		const double scale_weights[5] = {0.0448, 0.2856, 0.3001, 0.2363, 0.1333};
+		int num_scales = 1;
+		while (num_scales < 5 && std::min(truth.width(), truth.height()) >> num_scales >= 2 * ssim_radius + 1) num_scales++;
+		double weight_total = 0;
+		for (int j = 0; j < num_scales; j++) weight_total += scale_weights[j];
+
+		const float range = ssim_range(truth);
+		CImg<> e(est, false), t(truth, false), luminance, contrast;
+		double result = 1;
+		for (int j = 0; j < num_scales; j++) {
+			ssim_terms(e, t, range, luminance, contrast);
+			const float *const l = luminance.data(), *const c = contrast.data();
+			const long size = contrast.size();
+			double term = block_sum(size, [=](const long i) { return (double) c[i]; }) / size;
+			if (j == num_scales - 1) {
+				term = block_sum(size, [=](const long i) { return (double) l[i] * c[i]; }) / size;
+			}
+			result *= std::pow(std::max(term, 0.0), scale_weights[j] / weight_total);
+
+			if (j < num_scales - 1) {
+				e = e.get_crop(0, 0, 0, e.width() / 2 * 2 - 1, e.height() / 2 * 2 - 1, e.depth() - 1).resize(e.width() / 2, e.height() / 2, -100, -100, 2);
+				t = t.get_crop(0, 0, 0, t.width() / 2 * 2 - 1, t.height() / 2 * 2 - 1, t.depth() - 1).resize(t.width() / 2, t.height() / 2, -100, -100, 2);
+			}
+		}
+		return result;
+	}
+
+
+	double error_psnr(const CImg<> &est, const CImg<> &truth) {
+		// Peak taken as the range of the ground truth, as for SSIM
+		const float range = ssim_range(truth);
+		return 10 * std::log10(range * range / error_mse(est, truth));
+	}
+}
@@ -0,0 +1,134 @@
+#include "CImg.h"
+#include "fish.h"
+#include <omp.h>
+#include <cmath>
+
+using namespace cimg_library;
+
+
+namespace fish{
+	ImageStats::ImageStats() :
+		num_pixels(0), num_non_integer(0), num_negative(0), num_zero(0), num_above(0), min(0), max(0), sum(0), sum_squares(0) {
+	}
+
+
+	void ImageStats::add(const CImg<> &img) {
+		// One pass in fixed blocks: reductions vectorised within a block, then its integer values counted into
+		// the histogram of the thread. Block sums are combined pairwise, so results do not depend on threads.
+		const long size = img.size(), block = 4096, num_blocks = (size + block - 1) / block;
+		if (!size) return;
+		const float *const data = img.data();
+		std::vector<double> block_sums(num_blocks), block_squares(num_blocks);
+		long non_integer = 0, negative = 0, zero = 0, above = 0;
+		float lo = data[0], hi = data[0];
+
+		#pragma omp parallel
+		{
+			std::vector<long> counts;
+			#pragma omp for reduction(+:non_integer, negative, zero, above) reduction(min:lo) reduction(max:hi)
+			for (long b = 0; b < num_blocks; b++) {
+				const long start = b * block, end = std::min(size, start + block);
+				double s = 0, s2 = 0;
+				#pragma omp simd reduction(+:s, s2, non_integer, negative, zero) reduction(min:lo) reduction(max:hi)
+				for (long i = start; i < end; i++) {
+					const float v = data[i];
+					s += v;
+					s2 += (double) v * v;
+					non_integer += v != floorf(v);
+					negative += v < 0;
+					zero += v == 0;
+					lo = std::min(lo, v);
+					hi = std::max(hi, v);
+				}
+				block_sums[b] = s;
+				block_squares[b] = s2;
+
+				for (long i = start; i < end; i++) {
+					const float v = data[i];
+					if (!(v >= 0)) continue;
+					if (v >= histogram_bins) {
+						above++;
+						continue;
+					}
+					const int bin = v;
+					if (bin >= (int) counts.size()) counts.resize(bin + 1, 0);
+					counts[bin]++;
+				}
+			}
+
+			#pragma omp critical (image_stats)
+			{
+				if (counts.size() > histogram.size()) histogram.resize(counts.size(), 0);
+				for (size_t bin = 0; bin < counts.size(); bin++) histogram[bin] += counts[bin];
+			}
+		}
+
+		min = num_pixels ? std::min(min, lo) : lo;
+		max = num_pixels ? std::max(max, hi) : hi;
+		sum += pairwise_sum(block_sums.data(), num_blocks);
+		sum_squares += pairwise_sum(block_squares.data(), num_blocks);
+		num_pixels += size;
+		num_non_integer += non_integer;
+		num_negative += negative;
+		num_zero += zero;
+		num_above += above;
+	}
+
+
+	bool ImageStats::integral() const {
+		// Photon counts: non-negative integers only
+		return !num_non_integer && !num_negative;
+	}
+
+
+	double ImageStats::mean() const {
+		return num_pixels ? sum / num_pixels : 0;
+	}
+
+
+	double ImageStats::variance() const {
+		return num_pixels ? std::max(0.0, sum_squares / num_pixels - mean() * mean()) : 0;
+	}
+
+
+	double ImageStats::dispersion() const {
+		// Variance over mean, 1 for Poisson counts of a flat image (structure in the image raises it)
+		return mean() > 0 ? variance() / mean() : 0;
+	}
+
+
+	const char* ImageStats::dtype() const {
+		// Narrowest type holding every value exactly
+		if (!integral()) return "float32";
+		if (max <= 255) return "uint8";
+		if (max <= 65535) return "uint16";
+		if (max <= 4294967295.0) return "uint32";
+		return "float32";
+	}
+
+
+	void ImageStats::report_json(std::FILE* out) const {
+		std::fprintf(out, "{\n  \"pixels\": %ld,\n  \"min\": %.9g,\n  \"max\": %.9g,\n  \"mean\": %.9g,\n  \"variance\": %.9g,\n",
+					 num_pixels, min, max, mean(), variance());
+		std::fprintf(out, "  \"dispersion\": %.9g,\n  \"non_integer_fraction\": %.9g,\n  \"negative_fraction\": %.9g,\n"
+					 "  \"zero_fraction\": %.9g,\n", dispersion(), num_pixels ? (double) num_non_integer / num_pixels : 0.0,
+					 num_pixels ? (double) num_negative / num_pixels : 0.0, num_pixels ? (double) num_zero / num_pixels : 0.0);
+		std::fprintf(out, "  \"max_count\": %.9g,\n  \"dtype\": \"%s\",\n  \"histogram_above\": %ld,\n  \"histogram\": [",
+					 std::floor(max), dtype(), num_above);
+		for (size_t bin = 0; bin < histogram.size(); bin++) std::fprintf(out, "%s%ld", bin ? ", " : "", histogram[bin]);
+		std::fprintf(out, "]\n}\n");
+	}
+
+
+	ImageStats image_stats(const char* filename) {
+		// Stacks are streamed in batches of at least 64 frames, as reopening the file for each few frames walks
+		// its directory chain from the start every time
+		ImageStats stats;
+		const int num_frames = fish::tiff_num_frames(filename);
+		const int batch = std::max(64, omp_get_max_threads());
+		for (int first = 0; first < num_frames; first += batch) {
+			stats.add(fish::load_tiff(filename, first, std::min(first + batch, num_frames) - 1));
+		}
+		return stats;
+	}
+}
@@ -0,0 +1,112 @@
+#include "harness.h"
+#include <omp.h>
+
+// Checks of the photon-level guarantees of the kernels: photon-conserving methods keep the total count
+// exactly, results are counts, the same seed gives the same result, different seeds give different
+// results and results do not depend on the number of threads. Run by make test; exits with 1 on failure.
+
+static int num_failed = 0;
+
+
+void check(const bool passed, const char* kernel, const char* what) {
+	fprintf(stderr, "%s %-28s %s\n", passed ? "pass" : "FAIL", kernel, what);
+	if (!passed) num_failed++;
+}
+
+
+CImg<> photon_ball(const int width, const int height, const int depth, const float radius, const unsigned int seed) {
+	// Poisson counts of a smooth blob that is zero beyond radius of the centre, so kernels that move
+	// photons by a few pixels keep them all in the image
+	CImg<> img(width, height, depth, 1, 0);
+	const float cx = width / 2.0f, cy = height / 2.0f, cz = depth / 2.0f;
+	for (int z = 0; z < depth; z++) {
+		for (int y = 0; y < height; y++) {
+			std::default_random_engine generator = fish::random_generator(seed, z * height + y);
+			for (int x = 0; x < width; x++) {
+				const float r2 = (x - cx) * (x - cx) + (y - cy) * (y - cy) + (depth > 1 ? (z - cz) * (z - cz) : 0);
+				if (r2 >= radius * radius) continue;
+				std::poisson_distribution<> pdist(20 * exp(-r2 / (radius * radius / 4)) + 2);
+				img(x, y, z) = pdist(generator);
+			}
+		}
+	}
+	return img;
+}
+
+
+std::vector<Kernel> kernels() {
+	std::vector<Kernel> list = photon_kernels();
+	list.push_back(Kernel{"rotate3d_coord", [](const CImg<> &img) {
+		const float axis[3] = {1, 1, 0}, centre[3] = {img.width() / 2.0f, img.height() / 2.0f, img.depth() / 2.0f};
+		return fish::rotate3d(img, 30, axis, centre, "coord");
+	}, true, true, true});
+	return list;
+}
+
+
+CImg<> run(const Kernel &kernel, const CImg<> &img, const unsigned int seed, const int num_threads) {
+	omp_set_num_threads(num_threads);
+	fish::set_random_seed(seed);
+	const int saved = mute_stdout();
+	CImg<> out = kernel.run(img);
+	fish::restore_stdout(saved);
+	return out;
+}
+
+
+bool integral(const CImg<> &img) {
+	cimg_for(img, p, float) if (*p < 0 || *p != floorf(*p)) return false;
+	return true;
+}
+
+
+bool same(const CImg<> &a, const CImg<> &b) {
+	return a.is_sameXYZC(b) && !std::memcmp(a.data(), b.data(), a.size() * sizeof(float));
+}
+
+
+int main(int argc, char* argv[]) {
+	cimg_help("\nCheck photon conservation, seeding and thread independence of the kernels");
+	const int max_threads = cimg_option("-threads", std::max(4, omp_get_max_threads()), "thread count compared against one thread\n");
+	if (cimg_option("-h", false, 0)) {return 0;}
+
+	const CImg<> img = photon_ball(96, 80, 1, 30, 1), vol = photon_ball(40, 40, 40, 12, 2);
+	const std::vector<Kernel> list = kernels();
+	for (size_t k = 0; k < list.size(); k++) {
+		const Kernel &kernel = list[k];
+		const CImg<> &raw = kernel.volume ? vol : img;
+		const CImg<> out = run(kernel, raw, 1, 1);
+		check(integral(out), kernel.name, "gives photon counts");
+		if (kernel.conserves) check(out.sum() == raw.sum(), kernel.name, "keeps the photon count");
+		check(same(out, run(kernel, raw, 1, 1)), kernel.name, "repeats with the same seed");
+		check(same(out, run(kernel, raw, 1, max_threads)), kernel.name, "does not depend on the thread count");
+		if (kernel.stochastic) check(!same(out, run(kernel, raw, 2, 1)), kernel.name, "changes with the seed");
+	}
+
+	// A whole-pixel Fourier shift has nothing to interpolate, so it must move the counts unchanged
+	const Kernel shift{"translate_fourier", [](const CImg<> &img) { return fish::translate(img, 3, -2, "fourier"); }, false, true, true};
+	check(same(run(shift, img, 1, 1), img.get_shift(3, -2, 0, 0, 0)), shift.name, "moves counts unchanged by whole pixels");
+
+	// Volumes through a graph keep their depth, including nodes that work plane by plane
+	const Kernel graph{"graph_translate_binomial", [](const CImg<> &vol) {
+		fish::Graph g;
+		const int n = g.translate(g.input(vol), 1.5, 0.5, "binomial");
+		g.optimize();
+		return g.evaluate(n);
+	}, true, false, true};
+	const CImg<> moved = run(graph, vol, 1, 1);
+	check(moved.is_sameXYZC(vol), graph.name, "keeps the depth of a volume");
+	check(same(moved, run(graph, vol, 1, max_threads)), graph.name, "does not depend on the thread count");
+
+	// Bootstrap replicates draw from their own streams
+	const CImg<> est = run(list[0], img, 3, 1);
+	omp_set_num_threads(1);
+	fish::set_random_seed(1);
+	const std::vector<double> serial = fish::error_bootstrap(est, img, "rmse", 50, 8);
+	omp_set_num_threads(max_threads);
+	fish::set_random_seed(1);
+	check(serial == fish::error_bootstrap(est, img, "rmse", 50, 8), "error_bootstrap", "does not depend on the thread count");
+
+	fprintf(stderr, "\n%d check%s failed\n", num_failed, num_failed == 1 ? "" : "s");
+	return num_failed ? 1 : 0;
+}
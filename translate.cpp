@@ -2,13 +2,16 @@
 #include "fish.h"
 #include <random>
 #include <cassert>
+#include <vector>
+#include <cstdio>
+#include <omp.h>
 
 using namespace cimg_library;
 
 namespace fish{
 	CImg<> translate_coord(const CImg<> &raw, const float shift_x, const float shift_y) {
 		CImg<> translated(raw.width(), raw.height(), 1, 1, 0);
-		std::default_random_engine generator;
+		std::default_random_engine generator = fish::random_generator(fish::random_seed(), 0);
 		std::uniform_real_distribution<float> ddist(0.0, 1.0);
 
 		cimg_forXY(raw, x, y) {
@@ -30,7 +33,7 @@ namespace fish{
 	
 	CImg<> translate_binom(const CImg<> &raw, const float shift_x, const float shift_y) {
 		CImg<> translated(raw.width(), raw.height(), 1, 1, 0);
-		std::default_random_engine generator;
+		std::default_random_engine generator = fish::random_generator(fish::random_seed(), 0);
 
 		float further_x_weight = shift_x - floor(shift_x);
 		float further_y_weight = shift_y - floor(shift_y);
@@ -61,6 +64,89 @@ namespace fish{
 	}
 
 
+	CImg<> translate_fourier(const CImg<> &raw, const float shift_x, const float shift_y) {
+		const int width = raw.width(), height = raw.height();
+		const int spectrum_width = width / 2 + 1;
+		CImg<> translated(width, height, 1, 1, 0);
+		std::default_random_engine generator = fish::random_generator(fish::random_seed(), 0);
+
+		fish::RealFFT &f = fish::real_fft(width, height, 1, 1);
+		cimg_forXY(raw, x, y) {
+			f.real[y * width + x] = raw(x, y);
+		}
+		f.forward();
+
+		// Multiply by a separable phase ramp. Nyquist frequencies of even sizes have no
+		// partner to carry the imaginary part, so they only get the real part of the ramp.
+		std::vector<double> ramp_x_re(spectrum_width), ramp_x_im(spectrum_width);
+		for (int kx = 0; kx < spectrum_width; kx++) {
+			const double phase = -2 * M_PI * kx * shift_x / width;
+			const bool nyquist = 2 * kx == width;
+			ramp_x_re[kx] = std::cos(phase);
+			ramp_x_im[kx] = nyquist ? 0 : std::sin(phase);
+		}
+		#pragma omp parallel for
+		for (int ky = 0; ky < height; ky++) {
+			const int fy = (ky <= height / 2) ? ky : ky - height;
+			const double phase = -2 * M_PI * fy * shift_y / height;
+			const bool nyquist = 2 * ky == height;
+			const double ramp_y_re = std::cos(phase), ramp_y_im = nyquist ? 0 : std::sin(phase);
+			fftw_complex *const row = f.spectrum + (size_t) ky * spectrum_width;
+			for (int kx = 0; kx < spectrum_width; kx++) {
+				const double c = ramp_x_re[kx] * ramp_y_re - ramp_x_im[kx] * ramp_y_im;
+				const double d = ramp_x_re[kx] * ramp_y_im + ramp_x_im[kx] * ramp_y_re;
+				const double a = row[kx][0], b = row[kx][1];
+				row[kx][0] = a*c - b*d;
+				row[kx][1] = a*d + b*c;
+			}
+		}
+		f.backward();
+
+		// Drop what wrapped around from the opposite edge and clip the ringing, rescaling
+		// so the remaining expected photon count is preserved
+		const double norm = 1.0 / f.size;
+		double total = 0, positive = 0;
+		cimg_forXY(translated, x, y) {
+			const double source_x = x - shift_x, source_y = y - shift_y;
+			if (source_x < -0.5 || source_x >= width - 0.5 || source_y < -0.5 || source_y >= height - 0.5) continue;
+			const double v = f.real[y * width + x] * norm;
+			total += v;
+			if (v > 0) {
+				translated(x, y) = v;
+				positive += v;
+			}
+		}
+		if (positive > 0) translated *= total / positive;
+
+		// Thin back to counts without adding noise: every pixel keeps floor(v), and the photons left over
+		// from the clipped total are split multinomially over the fractional parts, so each pixel has
+		// expectation v and the total is exact. Values within rounding error of an integer are snapped, so
+		// integer shifts return the shifted counts unchanged.
+		const long size = translated.size();
+		double fraction = 0;
+		long whole = 0;
+		for (long i = 0; i < size; i++) {
+			const double v = translated[i], nearest = std::floor(v + 0.5);
+			translated[i] = std::abs(v - nearest) < 1e-4 ? nearest : v;
+			whole += (long) std::floor(translated[i]);
+			fraction += translated[i] - std::floor(translated[i]);
+		}
+		long remaining = std::max(0L, std::lround(total) - whole);
+		for (long i = 0; i < size; i++) {
+			const double base = std::floor(translated[i]), f = translated[i] - base;
+			translated[i] = base;
+			if (f <= 0 || remaining <= 0) continue;
+			std::binomial_distribution<long> bdist(remaining, fraction > f ? f / fraction : 1.0);
+			const long extra = bdist(generator);
+			translated[i] += extra;
+			remaining -= extra;
+			fraction -= f;
+		}
+
+		return translated;
+	}
+
+
 	CImg<> translate(const CImg<> &raw, const float shift_x, const float shift_y, const char* method) {
 		CImg<> translated;
 
@@ -70,6 +156,16 @@ namespace fish{
 			printf("coord draw method...");
 			fflush(stdout);
 			translated = translate_coord(raw, shift_x, shift_y);
+		} else if (!strcmp(method, "fourier")) {
+			printf("Fourier phase-ramp method...");
+			fflush(stdout);
+			translated = translate_fourier(raw, shift_x, shift_y);
+		} else if (!strcmp(method, "area")) {
+			printf("area-weighted method...");
+			fflush(stdout);
+			float affmat[16];
+			fish::affine_translation(shift_x, shift_y, 0, affmat);
+			translated = fish::affine_area(raw, affmat, raw.width(), raw.height(), raw.depth());
 		} else {
 			printf("binomial method...");
 			fflush(stdout);
@@ -80,4 +176,102 @@ namespace fish{
 
 		return translated;
 	}
+
+
+	bool load_trajectory(const char* filename, const int num_frames, std::vector<float> &shift_x,
+						 std::vector<float> &shift_y, std::vector<float> &angle) {
+		// CSV rows of frame,x,y[,angle]; a first line that does not parse is taken as a header, and other
+		// rows that do not parse or name a frame outside the stack are skipped with a warning. Frames
+		// without a row are left in place.
+		std::FILE* csv = std::fopen(filename, "r");
+		if (!csv) return false;
+		shift_x.assign(num_frames, 0);
+		shift_y.assign(num_frames, 0);
+		angle.assign(num_frames, 0);
+		char line[1024];
+		for (int line_num = 1; std::fgets(line, sizeof(line), csv); line_num++) {
+			int frame;
+			float x, y, a = 0;
+			if (sscanf(line, "%d , %f , %f , %f", &frame, &x, &y, &a) < 3) {
+				if (line_num > 1 && strspn(line, " \t\r\n") < strlen(line)) {
+					printf("\nWarning: skipping line %d of %s, which is not frame,x,y[,angle].\n", line_num, filename);
+				}
+				continue;
+			}
+			if (frame < 0 || frame >= num_frames) {
+				printf("\nWarning: skipping line %d of %s, as frame %d is not in the stack of %d frames.\n",
+					   line_num, filename, frame, num_frames);
+				continue;
+			}
+			shift_x[frame] = x;
+			shift_y[frame] = y;
+			angle[frame] = a;
+		}
+		std::fclose(csv);
+		return true;
+	}
+
+
+	void translate_trajectory(const char* file_in, const char* file_out, const std::vector<float> &shift_x,
+							  const std::vector<float> &shift_y, const std::vector<float> &angle, const char* method) {
+		// Move each frame of a stack by its own shift (and rotation about the frame centre, applied first).
+		// Frames are read in batches, so the TIFF directories are not walked again for every frame, moved in
+		// parallel and written in order through one writer. Frames draw from their own random streams so
+		// their noise is independent.
+		const int num_frames = shift_x.size();
+		const bool affine_method = !strcmp(method, "coord") || !strcmp(method, "area");
+		if (!affine_method && strcmp(method, "binomial") && strcmp(method, "fourier")) {
+			printf("\nTranslation method '%s' not supported.\n", method);
+			exit(1);
+		}
+		for (int frame = 0; frame < num_frames && !affine_method; frame++) {
+			if (angle[frame] != 0) {
+				printf("\nFrame %d is rotated, which the %s method cannot do; use coord or area.\n", frame, method);
+				exit(1);
+			}
+		}
+		const int batch = std::max(64, omp_get_max_threads());
+		CImg<> first = fish::load_tiff(file_in, 0, 0);
+		const unsigned int seed = fish::random_seed();
+
+		int start_time = cimg::time();
+		printf("\nTranslating %d frames along trajectory...", num_frames);
+		fflush(stdout);
+		TinyTIFFFile* tiff = fish::open_tiff(file_out, first.width(), first.height());
+		for (int first_frame = 0; first_frame < num_frames; first_frame += batch) {
+			const int last_frame = std::min(first_frame + batch, num_frames) - 1;
+			const CImg<> frames = fish::load_tiff(file_in, first_frame, last_frame);
+			std::vector<CImg<> > translated(last_frame - first_frame + 1);
+
+			#pragma omp parallel for schedule(dynamic)
+			for (int frame = first_frame; frame <= last_frame; frame++) {
+				const CImg<> raw = frames.get_slice(frame - first_frame);
+				CImg<> &out = translated[frame - first_frame];
+				fish::set_random_seed(seed + frame);
+				if (!strcmp(method, "binomial")) {
+					out = translate_binom(raw, shift_x[frame], shift_y[frame]);
+				} else if (!strcmp(method, "fourier")) {
+					out = translate_fourier(raw, shift_x[frame], shift_y[frame]);
+				} else {
+					float rotation[16], translation[16], affmat[16];
+					fish::affine_rotation(angle[frame], raw.width() / 2.0f, raw.height() / 2.0f, rotation);
+					fish::affine_translation(shift_x[frame], shift_y[frame], 0, translation);
+					fish::affine_compose(translation, rotation, affmat);
+					if (!strcmp(method, "coord")) {
+						out = fish::affine_coord(raw, affmat, raw.width(), raw.height(), raw.depth());
+					} else if (!strcmp(method, "area")) {
+						out = fish::affine_area(raw, affmat, raw.width(), raw.height(), raw.depth());
+					}
+				}
+				fish::set_random_seed(seed);
+			}
+
+			for (size_t k = 0; k < translated.size(); k++) {
+				fish::save_tiff_frames(tiff, translated[k], 0, 0);
+			}
+		}
+		fish::close_tiff(tiff);
+		int translation_time = cimg::time() - start_time;
+		printf(" (completed in %d ms)\n", translation_time);
+	}
 }
@@ -0,0 +1,131 @@
+#include "CImg.h"
+#include "fish.h"
+#include <random>
+#include <cmath>
+
+using namespace cimg_library;
+
+
+namespace fish{
+	// A photon at position p moves to p + d(p), where the displacement d is interpolated bilinearly
+	// between pixel centres. The field is width x height with dx and dy as two channels or two pages,
+	// and the same field is applied to every page of a stack.
+
+	const int warp_tile = 64;
+
+
+	CImg<> warp_field(const CImg<> &raw, const CImg<> &field) {
+		CImg<> f = (field.spectrum() == 1 && field.depth() == 2) ? field.get_permute_axes("xycz") : field;
+		if (f.width() != raw.width() || f.height() != raw.height() || f.depth() != 1 || f.spectrum() != 2) {
+			printf("\nDisplacement field must be %d x %d with two channels or pages (dx, dy).\n", raw.width(), raw.height());
+			exit(1);
+		}
+		return f;
+	}
+
+
+	CImg<> warp_coord(const CImg<> &raw, const CImg<> &field) {
+		const CImg<> f = warp_field(raw, field);
+		CImg<> warped(raw.width(), raw.height(), raw.depth(), 1, 0);
+		const unsigned int seed = fish::random_seed();
+		const int tiles_x = (raw.width() + warp_tile - 1) / warp_tile;
+		const int tiles_y = (raw.height() + warp_tile - 1) / warp_tile;
+
+		#pragma omp parallel for schedule(dynamic)
+		for (int tile = 0; tile < tiles_x * tiles_y * raw.depth(); tile++) {
+			const int x0 = tile % tiles_x * warp_tile, y0 = tile / tiles_x % tiles_y * warp_tile, z = tile / (tiles_x * tiles_y);
+			const int x1 = std::min(x0 + warp_tile, raw.width()), y1 = std::min(y0 + warp_tile, raw.height());
+			std::default_random_engine generator = fish::random_generator(seed, tile);
+			std::uniform_real_distribution<float> ddist(0.0, 1.0);
+			for (int y = y0; y < y1; y++) {
+				for (int x = x0; x < x1; x++) {
+					int photon_num = raw(x, y, z);
+					for (int i = 0; i < photon_num; i++) {
+						const float xpos = x + ddist(generator);
+						const float ypos = y + ddist(generator);
+						const int px = floor(xpos + f._linear_atXY(xpos - 0.5f, ypos - 0.5f, 0, 0));
+						const int py = floor(ypos + f._linear_atXY(xpos - 0.5f, ypos - 0.5f, 0, 1));
+						if (warped.containsXYZC(px, py, z)) {
+							#pragma omp atomic
+							warped(px, py, z) += 1;
+						}
+					}
+				}
+			}
+		}
+
+		return warped;
+	}
+
+
+	CImg<> warp_area(const CImg<> &raw, const CImg<> &field) {
+		// Each pixel is sampled on a regular sub-grid and its photons split multinomially between the
+		// output pixels the displaced sub-samples land in, as in affine_area. The sub-sample targets only
+		// depend on the field, so they are found once per pixel and shared by all pages of a stack.
+		const CImg<> f = warp_field(raw, field);
+		CImg<> warped(raw.width(), raw.height(), raw.depth(), 1, 0);
+		const unsigned int seed = fish::random_seed();
+		const int sub = 4, num_samples = sub * sub;
+		const int tiles_x = (raw.width() + warp_tile - 1) / warp_tile;
+		const int tiles_y = (raw.height() + warp_tile - 1) / warp_tile;
+		const long page_size = (long) raw.width() * raw.height();
+
+		#pragma omp parallel for schedule(dynamic)
+		for (int tile = 0; tile < tiles_x * tiles_y; tile++) {
+			const int x0 = tile % tiles_x * warp_tile, y0 = tile / tiles_x * warp_tile;
+			const int x1 = std::min(x0 + warp_tile, raw.width()), y1 = std::min(y0 + warp_tile, raw.height());
+			std::default_random_engine generator = fish::random_generator(seed, tile);
+			SampleTargets targets(num_samples), page_targets(num_samples);
+			for (int y = y0; y < y1; y++) {
+				for (int x = x0; x < x1; x++) {
+					bool empty = true;
+					for (int z = 0; z < raw.depth() && empty; z++) empty = raw(x, y, z) == 0;
+					if (empty) continue;
+
+					targets.clear();
+					for (int i = 0; i < num_samples; i++) {
+						const float xpos = x + (i % sub + 0.5f) / sub, ypos = y + (i / sub + 0.5f) / sub;
+						const int px = floor(xpos + f._linear_atXY(xpos - 0.5f, ypos - 0.5f, 0, 0));
+						const int py = floor(ypos + f._linear_atXY(xpos - 0.5f, ypos - 0.5f, 0, 1));
+						targets.add(warped.containsXYZC(px, py) ? (long) warped.offset(px, py) : -1);
+					}
+					for (int z = 0; z < raw.depth(); z++) {
+						const float v = raw(x, y, z);
+						if (v == 0) continue;
+						page_targets = targets;
+						for (int t = 0; t < targets.num_targets; t++) {
+							if (targets.targets[t] >= 0) page_targets.targets[t] += z * page_size;
+						}
+						page_targets.deposit(warped, v, generator);
+					}
+				}
+			}
+		}
+
+		return warped;
+	}
+
+
+	CImg<> warp(const CImg<> &raw, const CImg<> &field, const char* method) {
+		CImg<> warped;
+
+		int start_time = cimg::time();
+		printf("\nWarping image using ");
+		if (!strcmp(method, "coord")) {
+			printf("coord draw method...");
+			fflush(stdout);
+			warped = warp_coord(raw, field);
+		} else if (!strcmp(method, "area")) {
+			printf("area-weighted method...");
+			fflush(stdout);
+			warped = warp_area(raw, field);
+		} else {
+			printf("%s method not implemented.\n", method);
+			exit(1);
+		}
+		int warp_time = cimg::time() - start_time;
+		printf(" (completed in %d ms)\n", warp_time);
+
+		return warped;
+	}
+}